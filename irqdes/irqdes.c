@@ -14,19 +14,31 @@
  *    Pins are in pairs: <irq pin>,<drive pin>,..., up to 4 pairs can     *
  *    be given. Default: 16,21. Short each pair with a jumper.            *
  *                                                                        *
- *    Start the test with: "cat /dev/irqdes/pin<n>". Nothing is printed,  *
- *    actions and events are logged in /var/log/kern.log.                 *
+ *    Start the test with: "cat /dev/irqdes/pin<n>". At the end a table   *
+ *    of expected and seen interrupts is printed; actions and events are  *
+ *    logged in /var/log/kern.log. "cat /dev/irqdes/all" runs all the     *
+ *    pairs at the same time, each in its own kernel thread.              *
  *                                                                        *
  *    The following parameters can be djusted at insmod, or changed       *
  *    on the fly (effective at next "cat /dev/irq...."):                  *
  *       value    [0]  first level to be sent                             *
- *       cadence  [10] ms interval before and after each event/action     *
+ *       cadence_us [10000] us interval before and after each             *
+ *                     event/action, at least 5 us; it replaces           *
+ *                     cadence, that was in ms                            *
+ *       offset   [0]  ns from each enable/disable action to the next     *
+ *                     event, < 0 to send the event before the action;    *
+ *                     0: one cadence                                     *
  *       cycles   [5]  how many disable/enable cycles                     *
  *       ni       [5]  events before first enable                         *
  *       enab     [5]  events while enabled                               *
  *       disab    [4]  events while disabled                              *
  *       mode     [0]  0: use enable/disable_irq()                        *
  *                     1: use irq_set_irq_type()                          *
+ *       report   [0]  0: log interrupts from the service routine         *
+ *                     1: log interrupts later from a work queue          *
+ *                     2: trace events only                               *
+ *       cpus     [-1,...] per pair cpu of the sequencer thread;          *
+ *                     -1 = any cpu                                       *
  *                                                                        *
  *  Copyright: (2023) Marcello Carla'                                     *
  *  This program is free software; you can redistribute it and/or modify  *
@@ -45,10 +57,19 @@
 #include <linux/irq.h>
 #include <linux/cdev.h>         /* struct cdev */
 #include <linux/slab.h>         /* kmalloc */
+#include <linux/uaccess.h>      /* copy_to_user */
 #include <linux/delay.h>
+#include <linux/kfifo.h>        /* interrupts waiting to be logged */
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>      /* action and event sequencer */
+#include <linux/completion.h>
+#include <linux/kthread.h>      /* one sequencer thread per pair */
 
 #include <linux/gpio.h>
 
+#define CREATE_TRACE_POINTS
+#include "irqdes_trace.h"
+
 MODULE_LICENSE("GPL v2");
 
 /* constants */
@@ -58,6 +79,17 @@ MODULE_LICENSE("GPL v2");
 #define BASE_MINOR 0
 #define MAXPIN 8
 
+/* interrupt logging modes */
+
+#define REPORT_PRINTK 0
+#define REPORT_DEFER  1
+#define REPORT_TRACE  2
+#define NREPORT 64                /* interrupts waiting to be logged */
+#define SEQ_SPIN 20000            /* ns: closer steps are waited for in the timer */
+#define IRQDES_MARK 3             /* last step: only take the counts */
+#define SEQ_START 1000000         /* ns from thread creation to the common start */
+#define SEQ_MIN 5                 /* us: shortest cadence the sequencer can keep */
+
 /* global variables */
 
 static int debug = 0;
@@ -65,8 +97,10 @@ module_param (debug, int, S_IRUGO | S_IWUSR);
 
 static int value = 0;
 module_param (value, int, S_IRUGO | S_IWUSR);
-static int cadence = 10;
-module_param (cadence, int, S_IRUGO | S_IWUSR);
+static int cadence_us = 10000;
+module_param (cadence_us, int, S_IRUGO | S_IWUSR);
+static int offset = 0;
+module_param (offset, int, S_IRUGO | S_IWUSR);
 static int cycles = 5;
 module_param (cycles, int, S_IRUGO | S_IWUSR);
 static int ni = 5;
@@ -77,12 +111,14 @@ static int disab = 4;
 module_param (disab, int, S_IRUGO | S_IWUSR);
 static int mode = 0;
 module_param (mode, int, S_IRUGO | S_IWUSR);
+static int report = REPORT_PRINTK;
+module_param (report, int, S_IRUGO | S_IWUSR);
 
 static dev_t device=0;     /* base device number */
 static struct cdev cdev;
 static int cdev_flag=0;
 static struct class * dev_class=NULL;
-static struct device * dev_device[MAXPIN];
+static struct device * dev_device[MAXPIN/2 + 1];
 
 /* default pins are irq:16  drive:21 */
 
@@ -90,6 +126,40 @@ static int npins=2;
 static ushort pins[MAXPIN]={16,21};
 module_param_array (pins, ushort, &npins, S_IRUGO);
 
+/* cpu of the sequencer thread of each pair - the hrtimer is pinned there */
+
+static int ncpus=0;
+static int cpus[MAXPIN/2]={ [0 ... MAXPIN/2-1] = -1 };
+module_param_array (cpus, int, &ncpus, S_IRUGO | S_IWUSR);
+
+/* an interrupt as seen by the service routine, or an action of the
+   sequencer, for deferred logging */
+
+struct irq_report {
+        u64 time;                 /* ns timestamp */
+        int action;               /* IRQDES_... or -1 for an interrupt */
+        int drvval, val;          /* drive and irq line values */
+};
+
+/* a step of the sequence */
+
+struct step {
+        s64 at;                   /* ns from the start of the sequence */
+        int action;               /* IRQDES_... */
+        int level;                /* drive line level before the action */
+        u32 isr;                  /* interrupts serviced before the action */
+};
+
+/* results of the enable/disable cycles with the same line levels */
+
+struct tally {
+        u32 cycles;               /* enable actions */
+        u32 edges_off, irq_off;   /* edges and interrupts while disabled */
+        u32 exp_on, irq_on;       /* expected and seen interrupts at enable */
+        u32 edges_on, irq_edges;  /* edges and interrupts while enabled */
+        u32 spurious, lost;
+};
+
 struct pin_data {
         int irq;                  /* irq number associated with gpio line */
         int irqpin;               /* gpio interrupt line number */
@@ -97,7 +167,29 @@ struct pin_data {
         struct gpio_desc * igpio; /* gpio descriptor associated to irq line */
         struct gpio_desc * dgpio; /* gpio descriptor associated to drive line */
         int val;                  /* next value to be sent to drive line */
-        int cadence;              /* time delay before and after actions */
+        long cadence;             /* ns delay before and after actions */
+        long offset;              /* ns from an action to the next event, 0 = cadence */
+        int mode;                 /* 0: enable/disable_irq, 1: irq_set_irq_type */
+        struct hrtimer seq;       /* the sequencer */
+        struct step *steps;       /* the sequence */
+        int nsteps, next;         /* steps in the sequence, next to be done */
+        ktime_t start;            /* start of the sequence */
+        struct completion done;   /* end of the sequence, for the thread only */
+        struct completion finished;    /* the thread has stopped the timer */
+        struct task_struct *thread; /* the sequencer thread */
+        struct completion *go;    /* common start of all the threads */
+        int run;                  /* start the timer at <go>, 0 to abort */
+        DECLARE_KFIFO(reports, struct irq_report, NREPORT);
+        atomic_t unreported;      /* interrupts lost with the kfifo full */
+        atomic_t isr;             /* interrupts serviced */
+        struct work_struct report_work;
+};
+
+/* the pairs of an open device: one for pin<n>, all for /dev/irqdes/all */
+
+struct pair_set {
+        int n;
+        struct pin_data * pair[MAXPIN/2];
 };
 
 #define dbg_printk(level,frm,...) if (debug>=level)	\
@@ -109,70 +201,405 @@ struct pin_data {
 
 #define Event ((struct pin_data *) arg)
 irqreturn_t irq_service(int irq, void * arg) {
-
-        dbg_printk (0, "irq %d:%d - val %d -> %d\n", Event->irqpin, Event->irq,
-                gpiod_get_value(Event->dgpio), gpiod_get_value(Event->igpio));
+        struct irq_report r;
+
+        atomic_inc (&Event->isr);
+        r.drvval = gpiod_get_value(Event->dgpio);
+        r.val = gpiod_get_value(Event->igpio);
+        trace_irqdes_event (Event->irqpin, Event->irq, r.drvval, r.val);
+
+        switch (report) {
+        case REPORT_PRINTK:
+                dbg_printk (0, "irq %d:%d - val %d -> %d\n", Event->irqpin, Event->irq,
+                        r.drvval, r.val);
+                break;
+        case REPORT_DEFER:
+                r.time = ktime_get_ns();
+                r.action = -1;
+                if (kfifo_put (&Event->reports, r)) schedule_work (&Event->report_work);
+                else atomic_inc (&Event->unreported);
+                break;
+        }
 
         return IRQ_HANDLED;
 }
 
 /*
- *  toggle the irq line level (connect with a jumper drive gpio to irq gpio)
+ *  work queue - log the interrupts queued by the service routine
  */
 
-void edges (struct pin_data * events, int nev) {
-        int j;
-        for ( j=0 ; j<nev; j++ ) {
-                dbg_printk (0, "gpio %d - sending %d\n", events->irqpin, events->val);
+static void report_drain (struct work_struct *work) {
+        struct pin_data * event = container_of (work, struct pin_data, report_work);
+        struct irq_report r;
+        int lost;
+
+        while (kfifo_get (&event->reports, &r)) {
+                switch (r.action) {
+                case IRQDES_SEND:
+                        dbg_printk (0, "gpio %d - sending %d at %llu ns\n", event->irqpin,
+                                r.val, r.time);
+                        break;
+                case IRQDES_ENABLE:
+                case IRQDES_DISABLE:
+                        dbg_printk (0, "gpio %d - %s irq at %llu ns\n", event->irqpin,
+                                r.action == IRQDES_ENABLE ? "enabling" : "disabling", r.time);
+                        break;
+                default:
+                        dbg_printk (0, "irq %d:%d - val %d -> %d at %llu ns\n", event->irqpin,
+                                event->irq, r.drvval, r.val, r.time);
+                }
+        }
+        lost = atomic_xchg (&event->unreported, 0);
+        if (lost) dbg_printk (0, "gpio %d - %d interrupts not logged\n", event->irqpin, lost);
+}
+
+/*
+ *  log an action of the sequencer, as the interrupts are logged
+ */
+
+static void report_action (struct pin_data * events, int action, int val) {
+        struct irq_report r = { .action = action, .val = val };
+
+        trace_irqdes_action (events->irqpin, action, val);
+
+        switch (report) {
+        case REPORT_PRINTK:
+                if (action == IRQDES_SEND) {
+                        dbg_printk (0, "gpio %d - sending %d\n", events->irqpin, val);
+                } else {
+                        dbg_printk (0, "gpio %d - %s irq.\n", events->irqpin,
+                                action == IRQDES_ENABLE ? "enabling" : "disabling");
+                }
+                break;
+        case REPORT_DEFER:
+                r.time = ktime_get_ns();
+                if (kfifo_put (&events->reports, r)) schedule_work (&events->report_work);
+                else atomic_inc (&events->unreported);
+                break;
+        }
+}
+
+/*
+ *  do an action: toggle the irq line level (connect with a jumper drive
+ *  gpio to irq gpio), enable or disable the irq - from the hrtimer, so
+ *  disable_irq_nosync() in place of disable_irq()
+ */
+
+static void sequence_action (struct pin_data * events, int action) {
+        switch (action) {
+        case IRQDES_SEND:
                 gpiod_set_value(events->dgpio, events->val);
+                report_action (events, action, events->val);
                 events->val ^= 1;
-                msleep (events->cadence);
-         }
+                return;
+        case IRQDES_ENABLE:
+                if (events->mode) irq_set_irq_type (events->irq, IRQ_TYPE_EDGE_BOTH);
+                else enable_irq (events->irq);
+                break;
+        case IRQDES_DISABLE:
+                if (events->mode) irq_set_irq_type (events->irq, IRQ_TYPE_NONE);
+                else disable_irq_nosync (events->irq);
+                break;
+        case IRQDES_MARK:
+                return;
+        }
+        report_action (events, action, gpiod_get_value(events->dgpio));
 }
 
 /*
- *    read
+ *  sequencer - do all the steps that are due, wait in place for the
+ *  ones due within SEQ_SPIN ns, then set the timer for the next one
  */
 
-ssize_t read (struct file *filp, char *buf,
-              const size_t count, loff_t *ppos) {
+static enum hrtimer_restart sequence_step (struct hrtimer *timer) {
+        struct pin_data * events = container_of (timer, struct pin_data, seq);
+        struct step * st;
+        s64 wait;
+
+        while (events->next < events->nsteps) {
+                wait = events->steps[events->next].at -
+                        ktime_to_ns (ktime_sub (ktime_get(), events->start));
+                if (wait >= SEQ_SPIN) break;
+                if (wait > 0) ndelay (wait);
+                st = &events->steps[events->next++];
+                st->isr = atomic_read (&events->isr);
+                st->level = gpiod_get_value(events->dgpio) & 1;
+                sequence_action (events, st->action);
+        }
+
+        if (events->next == events->nsteps) {
+                complete (&events->done);
+                return HRTIMER_NORESTART;
+        }
+        hrtimer_set_expires (timer, ktime_add_ns (events->start,
+                                                  events->steps[events->next].at));
+        return HRTIMER_RESTART;
+}
+
+/*
+ *  add to the sequence an action at <*at> followed by <nev> events
+ *  <cadence> apart, the first <offset> from the action; move <*at> to
+ *  the time of the next action
+ */
 
-        struct pin_data * events = filp->private_data;
+static void sequence_add (struct pin_data * events, s64 *at, int action, int nev) {
+        struct step * st = events->steps + events->nsteps;
+        s64 edge = *at + (events->offset ? events->offset : events->cadence);
+        int j;
+
+        if (nev && edge < *at) {           /* event before the action */
+                *st++ = (struct step) { .at = edge, .action = IRQDES_SEND };
+                *st++ = (struct step) { .at = *at, .action = action };
+                j = 1;
+        } else {
+                *st++ = (struct step) { .at = *at, .action = action };
+                j = 0;
+        }
+        for ( ; j<nev ; j++ )
+                *st++ = (struct step) { .at = edge + (s64) j * events->cadence, .action = IRQDES_SEND };
+
+        events->nsteps = st - events->steps;
+        *at = (nev ? edge + (s64) (nev - 1) * events->cadence : *at) + events->cadence;
+}
+
+/*
+ *  result table - for each enable action, the interrupts while disabled,
+ *  at enable and while enabled, summed by line level at disable and at
+ *  enable. At enable, enable_irq() should replay one edge sent while
+ *  disabled; an irq type of IRQ_TYPE_NONE should not keep any.
+ */
+
+static int sequence_table (struct pin_data * events, char *text, int size) {
+        struct tally tally[5] = { };      /* by level at disable * 2 + at enable; all */
+        struct tally * t;
+        struct step * st = events->steps;
+        u32 irq_on, irq_edges, edges_off, edges_on;
+        int d = -1, e, n, j, leng;
+
+        for ( e=0 ; e<events->nsteps ; e++ ) {
+                if (st[e].action == IRQDES_DISABLE) d = e;
+                if (st[e].action != IRQDES_ENABLE || d < 0) continue;
+
+                for ( n=e+1 ; st[n].action == IRQDES_SEND ; n++ ) ;   /* the last is a mark */
+                edges_off = e - d - 1;
+                edges_on = n - e - 1;
+                irq_on = st[edges_on ? e + 1 : n].isr - st[e].isr;
+                irq_edges = edges_on ? st[n].isr - st[e + 1].isr : 0;
+
+                t = &tally[st[d].level * 2 + st[e].level];
+                t->cycles++;
+                t->edges_off += edges_off;
+                t->irq_off += st[e].isr - st[d].isr;
+                t->exp_on += events->mode == 0 && edges_off;
+                t->irq_on += irq_on;
+                t->edges_on += edges_on;
+                t->irq_edges += irq_edges;
+        }
+
+        for ( j=0 ; j<4 ; j++ ) {
+                t = &tally[j];
+                t->spurious = t->irq_off + (t->irq_on > t->exp_on ? t->irq_on - t->exp_on : 0) +
+                        (t->irq_edges > t->edges_on ? t->irq_edges - t->edges_on : 0);
+                t->lost = (t->exp_on > t->irq_on ? t->exp_on - t->irq_on : 0) +
+                        (t->edges_on > t->irq_edges ? t->edges_on - t->irq_edges : 0);
+                tally[4].cycles += t->cycles;
+                tally[4].edges_off += t->edges_off;
+                tally[4].irq_off += t->irq_off;
+                tally[4].exp_on += t->exp_on;
+                tally[4].irq_on += t->irq_on;
+                tally[4].edges_on += t->edges_on;
+                tally[4].irq_edges += t->irq_edges;
+                tally[4].spurious += t->spurious;
+                tally[4].lost += t->lost;
+        }
+
+        leng = scnprintf (text, size, "# gpio %d:%d - mode %d, cadence %ld us, offset %ld ns\n"
+                          "# off on cycles edges_off irq_off exp_on irq_on edges_on irq_edges"
+                          " spurious  lost\n", events->irqpin, events->drvpin, events->mode,
+                          events->cadence / 1000, events->offset);
+        for ( j=0 ; j<5 ; j++ ) {
+                t = &tally[j];
+                if (j < 4 && t->cycles == 0) continue;
+                leng += scnprintf (text + leng, size - leng, j < 4 ? "  %d  %d" : "  all",
+                                   j >> 1, j & 1);
+                leng += scnprintf (text + leng, size - leng, " %6u %9u %7u %6u %6u %8u %9u %8u %5u\n",
+                                   t->cycles, t->edges_off, t->irq_off, t->exp_on, t->irq_on,
+                                   t->edges_on, t->irq_edges, t->spurious, t->lost);
+        }
+        return leng;
+}
+
+/*
+ *  sequence_build - prepare the steps from the current parameters
+ */
+
+static int sequence_build (struct pin_data * events) {
         int j;
         int nc = cycles;
         int mi = ni;
         int me = enab;
         int md = disab;
-        int sel = mode; 
+        s64 at;
+
         events->val = value;
-        events->cadence = cadence;
+        events->cadence = cadence_us * 1000L;
+        events->offset = offset;
+        events->mode = mode;
 
-        dbg_printk (0, "gpio %d:%d - Disabling irq and starting test.\n",
-                events->irqpin, events->drvpin);
+        events->steps = kmalloc_array (2 + mi + nc * (2 + me + md), sizeof(struct step),
+                                       GFP_KERNEL);
+        if (events->steps == NULL) return -ENOMEM;
 
-        if (sel) irq_set_irq_type (events->irq, IRQ_TYPE_NONE);
-        else disable_irq (events->irq);
+        events->nsteps = 0;
+        at = events->cadence;
+        sequence_add (events, &at, IRQDES_DISABLE, mi);
+        for ( j=0 ; j<nc ; j++ ) {
+                sequence_add (events, &at, IRQDES_ENABLE, me);
+                sequence_add (events, &at, IRQDES_DISABLE, md);
+        }
+        sequence_add (events, &at, IRQDES_MARK, 0);
 
-        msleep (events->cadence);
-        edges(events, mi);
+        events->next = 0;
+        reinit_completion (&events->done);
+        reinit_completion (&events->finished);
+        return 0;
+}
 
-        for ( j=0 ; j<nc ; j++ ) {
-                dbg_printk (0, "gpio %d - enabling irq.\n", events->irqpin);
+/*
+ *  sequencer thread - wait for the common start, run the hrtimer pinned
+ *  to this cpu and wait for the end of the sequence, or for read() to
+ *  abort it; the thread is the only waiter of <done>
+ */
 
-                if (sel) irq_set_irq_type (events->irq, IRQ_TYPE_EDGE_BOTH);
-                else enable_irq (events->irq);
+static int sequence_thread (void *arg) {
+        struct pin_data * events = arg;
 
-                msleep (events->cadence);
-                edges(events, me);
-                dbg_printk (0, "gpio %d - disabling irq.\n", events->irqpin);
+        wait_for_completion (events->go);
+        if (events->run) {
+                dbg_printk (0, "gpio %d:%d - Disabling irq and starting test on cpu %d.\n",
+                            events->irqpin, events->drvpin, raw_smp_processor_id());
+                hrtimer_start (&events->seq, ktime_add_ns (events->start, events->steps[0].at),
+                               HRTIMER_MODE_ABS_PINNED_HARD);
+        }
+        wait_for_completion (&events->done);
+        hrtimer_cancel (&events->seq);
+        complete (&events->finished);
+
+        return 0;
+}
 
-                if (sel) irq_set_irq_type (events->irq, IRQ_TYPE_NONE);
-                else disable_irq (events->irq);
+/*
+ *  sequence_run - one thread for each pair of <set>, all started at the
+ *                 same time; wait for the end of all the sequences
+ */
 
-                msleep (events->cadence);
-                edges(events, md);
+static int sequence_run (struct pair_set * set) {
+        DECLARE_COMPLETION_ONSTACK(go);
+        struct pin_data * events;
+        struct task_struct * thread;
+        ktime_t start;
+        int j, status = 0;
+
+        for ( j=0 ; j<set->n ; j++ ) {
+                events = set->pair[j];
+                events->go = &go;
+                events->run = 0;
+                thread = kthread_create (sequence_thread, events, NAME "/%d", events->irqpin);
+                if (IS_ERR(thread)) {
+                        status = PTR_ERR(thread);
+                        break;
+                }
+                if (j < ncpus && cpus[j] >= 0) {
+                        if (cpus[j] >= nr_cpu_ids || !cpu_online (cpus[j])) {
+                                dbg_printk (0, "cpu %d not available for gpio %d\n",
+                                            cpus[j], events->irqpin);
+                        } else {
+                                kthread_bind (thread, cpus[j]);
+                        }
+                }
+                get_task_struct (thread);       /* for kthread_stop() after the thread ends */
+                events->thread = thread;
+                wake_up_process (thread);
         }
-        return -ERESTARTSYS;
+
+        if (status == 0) {
+                start = ktime_add_ns (ktime_get(), SEQ_START);
+                for ( j=0 ; j<set->n ; j++ ) {
+                        set->pair[j]->start = start;
+                        set->pair[j]->run = 1;
+                }
+        }
+        complete_all (&go);
+
+        for ( j=0 ; j<set->n && status == 0 ; j++ ) {
+                if (wait_for_completion_interruptible (&set->pair[j]->finished)) {
+                        dbg_printk (0, "gpio %d - sequence interrupted.\n", set->pair[j]->irqpin);
+                        status = -ERESTARTSYS;
+                }
+        }
+
+        for ( j=0 ; j<set->n ; j++ ) {
+                events = set->pair[j];
+                if (events->thread == NULL) continue;
+                if (status) complete (&events->done);   /* wake the thread, it cancels the timer */
+                kthread_stop (events->thread);
+                put_task_struct (events->thread);
+                events->thread = NULL;
+        }
+        return status;
+}
+
+/*
+ *    read - build the sequences, let the threads run them and return
+ *           the result tables; end of file at the next read
+ */
+
+ssize_t read (struct file *filp, char *buf,
+              const size_t count, loff_t *ppos) {
+
+        struct pair_set * set = filp->private_data;
+        char *text = NULL;
+        ssize_t leng;
+        int j, status = 0;
+
+        if (*ppos) return 0;
+
+        if (cadence_us < SEQ_MIN || cadence_us > LONG_MAX / 1000) {
+                dbg_printk (0, "cadence_us %d must be from %d to %ld us\n", cadence_us,
+                            SEQ_MIN, LONG_MAX / 1000);
+                return -EINVAL;
+        }
+        if (abs(offset) >= cadence_us * 1000L) {
+                dbg_printk (0, "offset %d ns must be shorter than cadence %d us\n", offset, cadence_us);
+                return -EINVAL;
+        }
+        for ( j=0 ; j<set->n && status == 0 ; j++ ) status = sequence_build (set->pair[j]);
+
+        if (status == 0) status = sequence_run (set);
+        if (status == 0) {
+                text = kmalloc (PAGE_SIZE, GFP_KERNEL);
+                if (text == NULL) status = -ENOMEM;
+        }
+
+        if (status == 0) {
+                for ( leng=0, j=0 ; j<set->n ; j++ ) {
+                        if (j) leng += scnprintf (text + leng, PAGE_SIZE - leng, "\n");
+                        leng += sequence_table (set->pair[j], text + leng, PAGE_SIZE - leng);
+                }
+                leng = min_t (size_t, leng, count);
+                if (copy_to_user (buf, text, leng)) leng = -EFAULT;
+                else *ppos += leng;
+        } else {
+                leng = status;
+        }
+
+        kfree (text);
+        for ( j=0 ; j<set->n ; j++ ) {
+                kfree (set->pair[j]->steps);
+                set->pair[j]->steps = NULL;
+        }
+
+        return leng;
 }
 
 /*
@@ -190,10 +617,12 @@ ssize_t write (struct file *filp, const char *user_buf,
 
 void resource_release (struct pin_data * event) {
 
+        hrtimer_cancel (&event->seq);
         if (event->irq) {
                disable_irq (event->irq); /* disable irq and wait for pending actions */
                free_irq(event->irq, event);
         }
+        cancel_work_sync (&event->report_work);
 
         if (event->dgpio) gpiod_put (event->dgpio);
         if (event->drvpin) gpio_free (event->drvpin);
@@ -208,37 +637,43 @@ void resource_release (struct pin_data * event) {
  */
 
 int release (struct inode *inode, struct file *filp) {
-        struct pin_data * event = filp->private_data;
+        struct pair_set * set = filp->private_data;
+        int j;
 
-        dbg_printk (0, "close request for pins %d:%d\n", event->irqpin, event->drvpin);
-        resource_release (event);
+        for ( j=0 ; j<set->n ; j++ ) {
+                dbg_printk (0, "close request for pins %d:%d\n",
+                            set->pair[j]->irqpin, set->pair[j]->drvpin);
+                resource_release (set->pair[j]);
+        }
+        kfree (set);
 
         return 0;
 }
 
 /*
- *    open
+ *    pair_open - acquire pair <minor> and register the interrupt routine
  */
 
-int open (struct inode *inode, struct file *filp) {
+static struct pin_data * pair_open (int minor) {
 
         int status;
         struct pin_data * event;
-        int minor = MINOR(inode->i_rdev);
         int irqpin = pins[minor*2];
         int drvpin = pins[minor*2+1];
-        
-        dbg_printk (0, "device %d:%d pin %d\n",
-                MAJOR(inode->i_rdev), minor, pins[minor*2]);
 
         /* create data structure for events on this pin */
 
         event = kzalloc (sizeof(struct pin_data), GFP_KERNEL);
         if (event == NULL) {
                 dbg_printk (0, "Unable to obtain memory\n");
-                return -ENOMEM;
+                return ERR_PTR(-ENOMEM);
         }
-        filp->private_data = event;     /* save for read() and release() */
+        INIT_KFIFO(event->reports);
+        INIT_WORK(&event->report_work, report_drain);
+        hrtimer_init (&event->seq, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+        event->seq.function = sequence_step;
+        init_completion (&event->done);
+        init_completion (&event->finished);
 
         /* allocate gpios - request from another process for same gpio fails here */
 
@@ -283,11 +718,46 @@ int open (struct inode *inode, struct file *filp) {
        
         dbg_printk(0, "Registered IRQ %d for pin %d.\n", event->irq, event->irqpin);
 
-        return 0;
+        return event;
 
 failure:
         resource_release (event);
-        return -1;
+        return ERR_PTR(-EPERM);
+}
+
+/*
+ *    open - pin<n> is one pair, minor <npins/2> is all the pairs
+ */
+
+int open (struct inode *inode, struct file *filp) {
+
+        struct pair_set * set;
+        int minor = MINOR(inode->i_rdev);
+        int ndev = npins/2;
+        int j, status;
+
+        dbg_printk (0, "device %d:%d pin %d\n",
+                MAJOR(inode->i_rdev), minor, minor < ndev ? pins[minor*2] : -1);
+
+        set = kzalloc (sizeof(struct pair_set), GFP_KERNEL);
+        if (set == NULL) {
+                dbg_printk (0, "Unable to obtain memory\n");
+                return -ENOMEM;
+        }
+
+        for ( j = minor < ndev ? minor : 0 ; j < (minor < ndev ? minor + 1 : ndev) ; j++ ) {
+                set->pair[set->n] = pair_open (j);
+                if (IS_ERR(set->pair[set->n])) {
+                        status = PTR_ERR(set->pair[set->n]);
+                        while (set->n--) resource_release (set->pair[set->n]);
+                        kfree (set);
+                        return status;
+                }
+                set->n++;
+        }
+        filp->private_data = set;       /* save for read() and release() */
+
+        return 0;
 }
 
 /*
@@ -313,13 +783,13 @@ static void mod_exit (void) {
         dbg_printk (0, "Unloading module.\n");
 
         major = MAJOR(device);
-        for ( j=0 ; j<ndev ; j++ ) {
+        for ( j=0 ; j<=ndev ; j++ ) {
                 if (dev_device[j]) device_destroy (dev_class,
                                             MKDEV(major, j + BASE_MINOR));
         }
         if (dev_class) class_destroy (dev_class);
         if (cdev_flag) cdev_del (&cdev);
-        if (device) unregister_chrdev_region(device, npins);
+        if (device) unregister_chrdev_region(device, ndev + 1);
 }
 
 /*
@@ -335,7 +805,7 @@ static int mod_init (void) {
 
         /* obtain major device number or exit */
 
-        status = alloc_chrdev_region (&device, BASE_MINOR, ndev, NAME);
+        status = alloc_chrdev_region (&device, BASE_MINOR, ndev + 1, NAME);
         if (status < 0) {
                 dbg_printk (0, "can't get major\n");
                 return status;
@@ -348,7 +818,7 @@ static int mod_init (void) {
         cdev_init(&cdev, &fops);
         cdev.owner = THIS_MODULE;
 
-        status = cdev_add (&cdev, device, ndev);
+        status = cdev_add (&cdev, device, ndev + 1);
         if (status) {
                 dbg_printk (0, "can't register device %d %ld\n", device, status);
                 goto failure;
@@ -378,6 +848,17 @@ static int mod_init (void) {
                 }
         }
 
+        /* all the pairs - minor <ndev> */
+
+        dev_device[ndev] = device_create(dev_class, NULL,
+                           MKDEV(major, ndev + BASE_MINOR), NULL, NAME "/all");
+        if (IS_ERR(dev_device[ndev])) {
+                dbg_printk (0, "create of device all failed\n");
+                status = (long) dev_device[ndev];
+                dev_device[ndev] = NULL;
+                goto failure;
+        }
+
         dbg_printk (0, "installed by \"%s\"\n", current->comm);
 
         return 0;
@@ -0,0 +1,91 @@
+/**************************************************************************
+ *    irqdes_trace.h - Trace events of the irqdes module                  *
+ *                                                                        *
+ *    Enable with:                                                        *
+ *      echo 1 > /sys/kernel/tracing/events/irqdes/enable                 *
+ *    and read the lock-free trace buffer in                              *
+ *      /sys/kernel/tracing/trace_pipe (or use perf/trace-cmd)            *
+ *                                                                        *
+ *  Copyright: (2023) Marcello Carla'                                     *
+ *  This program is free software; you can redistribute it and/or modify  *
+ *  it under the terms of the GNU General Public License as published by  *
+ *  the Free Software Foundation; either version 2 of the License, or     *
+ *  (at your option) any later version.                                   *
+ *                                                                        *
+ **************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM irqdes
+
+#if !defined(_IRQDES_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IRQDES_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* every call of the interrupt service routine */
+
+TRACE_EVENT(irqdes_event,
+
+        TP_PROTO(int pin, int irq, int drvval, int val),
+
+        TP_ARGS(pin, irq, drvval, val),
+
+        TP_STRUCT__entry(
+                __field(int, pin)
+                __field(int, irq)
+                __field(int, drvval)
+                __field(int, val)
+        ),
+
+        TP_fast_assign(
+                __entry->pin = pin;
+                __entry->irq = irq;
+                __entry->drvval = drvval;
+                __entry->val = val;
+        ),
+
+        TP_printk("irq %d:%d - val %d -> %d",
+                __entry->pin, __entry->irq, __entry->drvval, __entry->val)
+);
+
+/* an action on the drive line or on the irq line */
+
+#define IRQDES_SEND    0
+#define IRQDES_ENABLE  1
+#define IRQDES_DISABLE 2
+
+TRACE_EVENT(irqdes_action,
+
+        TP_PROTO(int pin, int action, int val),
+
+        TP_ARGS(pin, action, val),
+
+        TP_STRUCT__entry(
+                __field(int, pin)
+                __field(int, action)
+                __field(int, val)
+        ),
+
+        TP_fast_assign(
+                __entry->pin = pin;
+                __entry->action = action;
+                __entry->val = val;
+        ),
+
+        TP_printk("gpio %d - %s %d", __entry->pin,
+                __print_symbolic(__entry->action,
+                        { IRQDES_SEND, "sending" },
+                        { IRQDES_ENABLE, "enabling irq, level" },
+                        { IRQDES_DISABLE, "disabling irq, level" }),
+                __entry->val)
+);
+
+#endif /* _IRQDES_TRACE_H */
+
+/* this header is not in include/trace/events: tell define_trace.h where it is */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE irqdes_trace
+#include <trace/define_trace.h>
@@ -10,18 +10,81 @@
  *    A 1 kHz square wave is sent to pin <n>. Rising and falling edge     *
  *    interrupts should alternate every <cadence> +/- <tolerance> us.     *
  *                                                                        *
- *    Install with: insmod irqflow.ko pins=<pin 1>,<pin 2>....<pin 8>.    *
+ *    Install with: insmod irqflow.ko pins=<pin 1>,<pin 2>,...; up to 54  *
+ *    pins, every gpio line of the BCM2835.                               *
  *    Default is pins=16,21                                               *
  *                                                                        *
+ *    Without a square wave generator, load with drvpins=<drive 1>,...    *
+ *    and short each pin with its drive pin: the module itself toggles    *
+ *    the drive pins every <cadence> us with an hrtimer.                  *
+ *                                                                        *
+ *    With drive pins for the first two pins, cat /dev/irqflow/sweep      *
+ *    toggles both drive pins together, the first pin lagging             *
+ *    the second by a delay stepped from <sweepfrom> to <sweepto> ns,     *
+ *    and prints the lost edges on each pin for each delay.               *
+ *                                                                        *
  *    Start the test with: cat /dev/irqflow/pin<n>. Every <setsize>       *
  *    events a statistic summary is printed. Bad events are logged in     *
  *    /var/log/kern.log. Stop the test with Ctrl-c.                       *
+ *    With the device open, the ioctls in irqflow.h arm and disarm the    *
+ *    checks, reset the counters and take their snapshot.                 *
  *                                                                        *
  *    Module parameters, adjustable at insmod or on the fly, are:         *
  *        setsize      [10000 events] frequency of the statistic summary  *
  *        cadence      [500 us] expected interval from interrupt to       *
  *                              interrupt                                 *
  *        tolerance    [100 us] allowed skew in interrupt interval        *
+ *        sweepfrom    [0 ns]   first delay of the sweep (may be < 0)     *
+ *        sweepto      [15000 ns] last delay of the sweep                 *
+ *        sweepstep    [100 ns] delay step of the sweep                   *
+ *        sweepsize    [50000 events] events per pin for each delay       *
+ *        dispatchgap  [2000 ns] largest gap between two handlers of the  *
+ *                              same gpio bank interrupt                  *
+ *        skew         [1]      1: correlate every edge with the other    *
+ *                                 pins                                   *
+ *        dispatch     [1]      1: account the gpio bank dispatches       *
+ *        report       [1]      how bad events are logged:                *
+ *                              0 printk from the interrupt routine       *
+ *                              1 deferred printk from a work queue       *
+ *                              2 trace events only                       *
+ *                                                                        *
+ *    cadence, tolerance and setsize can also be set for each pin, in     *
+ *    /sys/class/irqflow/irqflow!pin<n>/; effective at the next event.    *
+ *                                                                        *
+ *    The last <history> set summaries of each pin are kept while the     *
+ *    module is loaded, across close and open, in                         *
+ *    /sys/kernel/debug/irqflow/history/pin<n>.                           *
+ *                                                                        *
+ *    Module parameters, effective at load only, are:                     *
+ *        history      [256 sets] summaries kept per pin; a power of 2,   *
+ *                                0 = none                                *
+ *                                                                        *
+ *    Module parameters, effective at next open, are:                     *
+ *        ringsize     [0 events] slots of the mmap'able event ring;      *
+ *                                a power of 2, 0 = no ring               *
+ *        binary       [0]      0: read() returns text lines              *
+ *                              1: read() returns irqflow_summary         *
+ *        track        [0 ns]   0: judge intervals against cadence and    *
+ *                                 tolerance                              *
+ *                              n: follow the real period and judge each  *
+ *                                 event within +/- n ns of the expected  *
+ *                                 time                                   *
+ *        snapwin      [16 events] events kept before and after each bad  *
+ *                              event in the flight recorder, 0 = none    *
+ *        split        [0]      0: check events in the interrupt routine  *
+ *                              1: the interrupt routine only takes the   *
+ *                                 time and the value, the checks run in  *
+ *                                 the irq thread                         *
+ *        countonly    [0]      1: the interrupt routine only counts the  *
+ *                                 events and times itself, no checks;    *
+ *                                 read() gives the rate every second     *
+ *        affinity     [-1,...] per pin cpu to service the irq;           *
+ *                              -1 = any cpu                              *
+ *        timesource   [0]      clock of the event timestamps:            *
+ *                              0 ktime_get_ns()                          *
+ *                              1 ktime_get_mono_fast_ns()                *
+ *                              2 local_clock()                           *
+ *                              3 raw arch counter                        *
  *                                                                        *
  *                                                                        *
  *  Copyright: (2023) Marcello Carla'                                     *
@@ -41,10 +104,40 @@
 #include <linux/cdev.h>         /* struct cdev */
 #include <linux/uaccess.h>      /* copy_to_user */
 #include <linux/slab.h>         /* kmalloc */
+#include <linux/vmalloc.h>      /* vmalloc_user */
+#include <linux/mm.h>           /* remap_vmalloc_range */
+#include <linux/debugfs.h>      /* histogram files */
+#include <linux/seq_file.h>
+#include <linux/kfifo.h>        /* anomalies waiting to be logged */
+#include <linux/workqueue.h>
+#include <linux/poll.h>         /* poll_wait */
+#include <linux/mutex.h>
+#include <linux/percpu.h>       /* per cpu statistics */
+#include <linux/cpumask.h>
 #include <linux/delay.h>
+#include <linux/sched/clock.h>  /* local_clock */
+#include <linux/clocksource.h>  /* clocks_calc_mult_shift */
+#include <linux/timex.h>        /* get_cycles */
+#include <linux/hrtimer.h>      /* drive pin generator */
+#include <linux/rcupdate.h>     /* per pin configuration */
+#include <linux/completion.h>   /* statistics snapshot */
+#include <linux/seqlock.h>      /* last set summary */
+#include <linux/jump_label.h>   /* optional stages of the interrupt routine */
+
+#ifdef CONFIG_ARM_ARCH_TIMER      /* the 64 bit counter behind the arm clocksource */
+#include <clocksource/arm_arch_timer.h>
+#define read_counter() arch_timer_read_counter()
+#else
+#define read_counter() ((u64) get_cycles())
+#endif
 
 #include <linux/gpio.h>
 
+#include "irqflow.h"
+
+#define CREATE_TRACE_POINTS
+#include "irqflow_trace.h"
+
 MODULE_LICENSE("GPL v2");
 
 /* constants */
@@ -52,142 +145,1961 @@ MODULE_LICENSE("GPL v2");
 #define NAME "irqflow"
 #define HERE  NAME, (char *) __FUNCTION__
 #define BASE_MINOR 0
-#define MAXPIN 8
+#define MAXPIN 54                 /* gpio lines of the BCM2835 */
+
+/* log-linear histogram: 8 linear bins, then 8 bins per power of 2;
+   values from 2^(HIST_MSB+1) on go in the last bin */
+
+#define HIST_SUB 3
+#define HIST_MSB 30
+#define HBINS ((HIST_MSB - HIST_SUB + 2) << HIST_SUB)
+
+/* bad event logging modes */
+
+#define REPORT_PRINTK 0
+#define REPORT_DEFER  1
+#define REPORT_TRACE  2
+#define NANOMALY 64               /* bad events waiting to be logged */
+#define NSUMMARY 64               /* set summaries waiting for read() */
+#define NSTAMP 256                /* split mode: events waiting for the irq thread */
+#define NFLIGHT 64                /* flight recorder: last events, a power of 2 */
+#define MAXWIN (NFLIGHT/2 - 1)    /* flight recorder: largest <snapwin> */
+#define NSNAP 16                  /* flight recorder: snapshots waiting to be read */
+#define NBANK 3                   /* gpio banks: BCM2835 gpio 0-27, 28-45, 46-53 */
+#define BANK(pin) ((pin) < 28 ? 0 : (pin) < 46 ? 1 : 2)
+#define NDPOS 8                   /* bank dispatch: positions counted, the last for all later */
+#define NEDGE 4                   /* correlation: last edges kept for each pin, a power of 2 */
+
+/* kinds of bad events */
+
+#define BAD_NONE  0
+#define BAD_LOST  1               /* edges missed between two events */
+#define BAD_LATE  2               /* interval longer than <cadence> + <tolerance> */
+#define BAD_EARLY 3               /* interval shorter than <cadence> - <tolerance> */
+#define BAD_DUP   4               /* an edge seen twice */
+#define NBAD      5
+
+/* tracking mode: a second order loop on the period of the flow */
+
+#define TRACK_Q    16             /* fractional bits of the tracked period */
+#define TRACK_KP   3              /* phase gain 1/8 */
+#define TRACK_KI   8              /* period gain 1/256 */
+#define TRACK_LOCK 256            /* events before the tracked window is used */
+
+/* timestamp sources */
+
+#define TSRC_KTIME  0             /* ktime_get_ns */
+#define TSRC_FAST   1             /* ktime_get_mono_fast_ns */
+#define TSRC_LOCAL  2             /* local_clock */
+#define TSRC_COUNTER 3            /* raw arch counter, scaled to ns */
+#define NTSRC       4
+#define NBENCH 1000               /* calls per timestamp source in the benchmark */
+
+/* session control */
+
+#define STAT_WAIT 100             /* ms to wait for an event to take the statistics */
+
+/* phase delay sweep */
+
+#define SWEEP_SETTLE 20           /* ms before counting at a new delay */
+#define SWEEP_IDLE 10             /* 100 ms waits without events to give up */
+#define SWEEP_SPIN 20000          /* ns: shorter delays are waited for in the timer */
+
+/* optional stages of the interrupt routine - static keys switched by
+   their module parameters, so that a stage that is off costs a nop */
+
+static DEFINE_STATIC_KEY_FALSE(debug_key);     /* debug > 0 */
+static DEFINE_STATIC_KEY_TRUE(skew_key);       /* skew */
+static DEFINE_STATIC_KEY_TRUE(dispatch_key);   /* dispatch */
+
+static void keys_update (void);
+
+static int key_set (const char *val, const struct kernel_param *kp) {
+        int status = param_set_int (val, kp);
+
+        if (status == 0) keys_update ();
+        return status;
+}
+
+static const struct kernel_param_ops key_ops = {
+        .set = key_set,
+        .get = param_get_int,
+};
+
+/* parameters the interrupt routine divides or counts by: > 0, at load
+   and on the fly */
+
+static int positive_set (const char *val, const struct kernel_param *kp) {
+        int n;
+
+        if (kstrtoint (val, 0, &n) || n <= 0) return -EINVAL;
+        *(int *) kp->arg = n;
+        return 0;
+}
+
+static const struct kernel_param_ops positive_ops = {
+        .set = positive_set,
+        .get = param_get_int,
+};
+
+/* user parameters */
+
+static int debug = 0;
+module_param_cb (debug, &key_ops, &debug, S_IRUGO | S_IWUSR);
+static int setsize = 10000;
+module_param_cb (setsize, &positive_ops, &setsize, S_IRUGO | S_IWUSR);
+static int cadence = 500;
+module_param_cb (cadence, &positive_ops, &cadence, S_IRUGO | S_IWUSR);
+static int tolerance = 100;
+module_param (tolerance, int, S_IRUGO | S_IWUSR);
+static int dispatchgap = 2000;
+module_param (dispatchgap, int, S_IRUGO | S_IWUSR);
+static int skew = 1;
+module_param_cb (skew, &key_ops, &skew, S_IRUGO | S_IWUSR);
+static int dispatch = 1;
+module_param_cb (dispatch, &key_ops, &dispatch, S_IRUGO | S_IWUSR);
+static int report = REPORT_DEFER;
+module_param (report, int, S_IRUGO | S_IWUSR);
+static int sweepfrom = 0;
+module_param (sweepfrom, int, S_IRUGO | S_IWUSR);
+static int sweepto = 15000;
+module_param (sweepto, int, S_IRUGO | S_IWUSR);
+static int sweepstep = 100;
+module_param (sweepstep, int, S_IRUGO | S_IWUSR);
+static int sweepsize = 50000;
+module_param (sweepsize, int, S_IRUGO | S_IWUSR);
+static int ringsize = 0;
+module_param (ringsize, int, S_IRUGO | S_IWUSR);
+static int binary = 0;
+module_param (binary, int, S_IRUGO | S_IWUSR);
+static int split = 0;
+module_param (split, int, S_IRUGO | S_IWUSR);
+static int track = 0;
+module_param (track, int, S_IRUGO | S_IWUSR);
+static int snapwin = 16;
+module_param (snapwin, int, S_IRUGO | S_IWUSR);
+static int timesource = TSRC_KTIME;
+module_param (timesource, int, S_IRUGO | S_IWUSR);
+static int countonly = 0;
+module_param (countonly, int, S_IRUGO | S_IWUSR);
+static int history = 256;
+module_param (history, int, S_IRUGO);
+
+static void keys_update (void) {
+        if (debug > 0) static_branch_enable (&debug_key);
+        else static_branch_disable (&debug_key);
+        if (skew) static_branch_enable (&skew_key);
+        else static_branch_disable (&skew_key);
+        if (dispatch) static_branch_enable (&dispatch_key);
+        else static_branch_disable (&dispatch_key);
+}
+
+/* global variables */
+
+static dev_t device=0;                 /* base device number */
+static struct cdev cdev;
+static int cdev_flag=0;
+static struct class * dev_class=NULL;
+static struct device ** dev_device=NULL;       /* npins + 1, the last is the sweep */
+static struct dentry * debug_dir;      /* /sys/kernel/debug/irqflow */
+static u32 cnt_freq;                   /* arch counter Hz, 0 if not available */
+static u32 cnt_mult, cnt_shift;        /* counter ticks to ns scaling */
+
+static const char * const bad_name[NBAD] = {
+        "", "lost", "late", "early", "duplicate",
+};
+
+static const char * const tsrc_name[NTSRC] = {
+        "ktime", "mono_fast", "local_clock", "counter",
+};
+
+/* default interrupt pin is #21; up to MAXPIN pins can be declared
+                      at load time with pins=<pin0>,<pin1>, .... */
+
+static int npins=2;
+static ushort pins[MAXPIN]={16,21};
+module_param_array (pins, ushort, &npins, S_IRUGO);
+
+/* cpu to service the irq of each pin, in the same order as pins=...;
+   -1 leaves the choice to the system */
+
+static int naffinity=0;
+static int affinity[MAXPIN]={ [0 ... MAXPIN-1] = -1 };
+module_param_array (affinity, int, &naffinity, S_IRUGO | S_IWUSR);
+
+/* drive pin of each pin, in the same order as pins=...; the module
+   toggles it every <cadence> us - 0 for an external generator */
+
+static int ndrvpins=0;
+static ushort drvpins[MAXPIN];
+module_param_array (drvpins, ushort, &ndrvpins, S_IRUGO);
+
+/* a bad event as seen by the interrupt routine, for deferred logging */
+
+struct anomaly {
+        int oldval, val;          /* previous and current line value */
+        long nsdiff, olddiff;     /* ns current and previous interval */
+        long bad, count;          /* bad events and events in the set */
+        int kind;                 /* BAD_... */
+        int near;                 /* lost edge: nearest edge on this gpio, -1 if none */
+        long nearns;              /* ns from the lost edge to that edge */
+};
+
+/* an event as taken by the interrupt routine */
+
+struct stamp {
+        u64 now;                  /* ns interrupt time */
+        int val;                  /* line value */
+        int cpu;                  /* cpu that serviced the interrupt */
+        u32 cost;                 /* ns spent in the interrupt routine */
+        u32 lat;                  /* ns from the drive pin toggle */
+};
+
+/* an event in the flight recorder */
+
+struct flight {
+        u64 time;                 /* ns interrupt time */
+        long nsdiff;              /* ns interval from the previous event */
+        int val;                  /* line value */
+        int cpu;                  /* cpu that serviced the interrupt */
+};
+
+/* the events around a bad event: the writer takes a FREE slot and
+   makes it READY when full, the reader frees it when done */
+
+#define SNAP_FREE    0
+#define SNAP_FILLING 1
+#define SNAP_READY   2
+
+struct snapshot {
+        int state;                /* SNAP_... */
+        int kind;                 /* BAD_... of the triggering event */
+        u64 seq;                  /* event number of the triggering event */
+        int n;                    /* events in the snapshot */
+        int first;                /* index of the triggering event in ev[] */
+        int after;                /* events still to be added */
+        struct flight ev[2*MAXWIN+1];
+};
+
+/* cross-pin correlation: the last edges of each open pin, written by
+   its own interrupt routine and read by the others without locks; one
+   cache line each, not to bounce the line of a pin with its writer */
+
+struct edge_log {
+        atomic64_t t[NEDGE];      /* ns edge times, 0 if none */
+        int next;                 /* slot of the next edge - writer only */
+        int tsource;              /* clock of the edge times, -1 if the pin is closed */
+} ____cacheline_aligned_in_smp;
+
+/* skew histograms of a pin since open */
+
+struct skew_pair {
+        u32 hist[HBINS];          /* ns from the nearest edge of the other pin */
+        u32 nlost;                /* lost edges nearest to an edge of the other pin */
+};
+
+struct skew_hist {
+        u32 lost[HBINS];          /* ns from a lost edge to the nearest edge of any pin */
+        struct skew_pair pair[];  /* one for each pin in pins[] */
+};
+
+static struct edge_log * edges;        /* one for each pin in pins[] */
+
+/* the handlers run by one gpio bank interrupt on one cpu: handlers
+   starting within <dispatchgap> ns from the end of the previous one
+   are taken as the same dispatch */
+
+struct dispatch {
+        u64 first;                /* ns start of the first handler */
+        u64 lastin;               /* ns start of the last handler */
+        u64 end;                  /* ns end of the last handler */
+        int n;                    /* handlers in the dispatch so far */
+        int tsource;              /* clock of the times */
+        u64 count, handlers;      /* dispatches closed and their handlers */
+        u32 size[NDPOS+1];        /* dispatches with 1 ... NDPOS or more handlers */
+        u32 span[HBINS];          /* ns first to last handler, 2 or more handlers */
+};
+
+struct bank_cpu {
+        struct dispatch bank[NBANK];
+};
+static struct bank_cpu __percpu *banks;
+static struct kmem_cache * pin_cache;  /* cache line aligned struct pin_data */
+
+/* per pin configuration from sysfs, replaced as a whole and published
+   with RCU; 0 in a field or no configuration: the module parameter */
+
+struct pin_config {
+        u32 gen;                  /* changes at every update */
+        int cadence;              /* us */
+        int tolerance;            /* us */
+        int setsize;              /* events */
+        struct rcu_head rcu;
+};
+
+static struct pin_config __rcu ** pconf;       /* one for each pin in pins[] */
+static DEFINE_MUTEX(conf_lock);                /* one update at a time */
+static u32 conf_gen;                           /* last generation, under conf_lock */
+static struct pin_data __rcu ** live;          /* the open pins, for the sysfs counters */
+
+/* the last <history> set summaries of each pin, kept while the module
+   is loaded; the checker of the pin fills record (head % history) and
+   then advances head, a reader drops the records overwritten while it
+   was copying them */
+
+struct set_record {
+        u64 time;                 /* ns real time of the end of the set */
+        u32 run;                  /* open of the pin since load */
+        struct irqflow_summary sum;
+};
+
+struct set_log {
+        u32 head;                 /* records written since load */
+        u32 mask;                 /* history - 1 */
+        u32 run;                  /* opens of the pin since load */
+        struct set_record rec[];
+};
+
+static struct set_log ** setlogs;              /* one for each pin in pins[], NULL if no history */
+
+/* events serviced by one cpu since open */
+
+struct cpu_stat {
+        u64 count, bad;           /* events and bad events */
+        u64 nssum;                /* ns sum of the intervals ending on this cpu */
+        long imin, imax;          /* ns shortest and longest interval */
+        long devmax;              /* ns largest deviation from cadence */
+        u64 hardns;               /* ns in the interrupt routine */
+};
+
+/* counters for the interrupt rate, summed over the cpus */
+
+struct rate {
+        u64 time;                 /* ns when taken */
+        u64 events;               /* events serviced */
+        u64 hardns;               /* ns in the interrupt routine */
+        u64 toggles;              /* drive pin toggles */
+};
+
+/* the state of a pin: allocated cache line aligned, with the fields
+   written at every interrupt apart from those set at open and from
+   those of the readers, so that pins serviced on different cpus and
+   the readers of a pin do not share cache lines */
+
+struct pin_data {
+        /* set at open, only read by the interrupt routine */
+        int irq;                  /* irq number associated with gpio line */
+        int pin;                  /* gpio line number */
+        struct gpio_desc *gpio;   /* gpio descriptor associated to gpio line */
+        int idle;                 /* disarmed: do nothing with interrupts */
+        int binary;               /* read() format */
+        int split;                /* events checked in the irq thread */
+        int countonly;            /* events only counted, not checked */
+        struct cpu_stat __percpu *cpustat;
+        int cpu;                  /* cpu the irq is bound to, -1 if none */
+        long tmax, tmin;          /* ns time limits of interrupt interval */
+        long cadence;             /* ns expected interval */
+        int setsize;              /* events in a set */
+        u32 cgen;                 /* generation of the configuration in use */
+        long track;               /* ns tracking window, 0 if not tracking */
+        int tsource;              /* clock of the timestamps */
+        int minor;                /* index in pins[] */
+        int bank;                 /* gpio bank of the pin */
+        struct skew_hist *skew;   /* correlation with the other pins */
+        int drvpin;               /* gpio drive line number, 0 if none */
+        struct gpio_desc *dgpio;  /* gpio descriptor associated to drive line */
+        int snapwin;              /* events before and after a bad event */
+        struct snapshot *snap;    /* NSNAP snapshots, NULL if none */
+        struct irqflow_ring *ring;     /* mmap'able event ring, NULL if none */
+        struct irqflow_event *revent;  /* first slot of the event ring */
+        u32 rmask;                /* ring slots - 1 */
+
+        /* written by the interrupt routine at every event */
+        u64 last                  /* ns last interrupt time */
+                ____cacheline_aligned_in_smp;
+        u64 first;                /* ns first interrupt time of the set */
+        long count, bad;          /* events and bad events count */
+        u32 kinds[NBAD];          /* bad events of each kind in the set */
+        u32 missed;               /* edges missed in the set */
+        u64 total, totalbad;      /* events and bad events since open */
+        u64 lost;                 /* lost edge events since open */
+        int val;                  /* last line value */
+        long nsdiff;              /* ns last time interval */
+        long imin, imax;          /* ns shortest and longest interval of the set */
+        long amin, amax;          /* ns shortest and longest interval since open */
+        u32 nset;                 /* sets completed since open */
+        u64 hardns;               /* ns in the interrupt routine in the set */
+        u32 hardmax;              /* longest interrupt routine in the set */
+        u32 hcost;                /* ns in the interrupt routine, last event */
+        u64 latns;                /* ns from the drive pin toggles in the set */
+        u32 latmax;               /* longest drive to interrupt latency in the set */
+        DECLARE_KFIFO(stamps, struct stamp, NSTAMP);
+        u32 dropped;              /* split mode: events lost with the kfifo full */
+        u32 dropseen;             /* split mode: dropped events already in a summary */
+        s64 tperiod;              /* tracked period, ns << TRACK_Q */
+        u64 tnext[2];             /* ns expected time of the next event with value 0, 1 */
+        int tlock;                /* events tracked, up to TRACK_LOCK */
+        u32 phmax;                /* ns largest phase error in the set */
+        u32 dpos[NDPOS];          /* handlers at each position in the bank dispatch */
+        u64 dwaitns;              /* ns from the dispatch start to the handlers */
+        u32 dwaitmax;             /* longest wait from the dispatch start */
+        u32 hint[HBINS];          /* intervals in the current set */
+        u32 hdev[HBINS];          /* deviations from cadence in the current set */
+        u32 hint_all[HBINS];      /* intervals since open */
+        u32 hdev_all[HBINS];      /* deviations from cadence since open */
+        u32 hlat_all[HBINS];      /* drive to interrupt latencies since open */
+        struct flight flight[NFLIGHT];  /* flight recorder: last events */
+        u64 seq;                  /* events recorded since open */
+        int filling;              /* snapshots in SNAP_FILLING */
+        u32 snaplost;             /* bad events without a free snapshot */
+        u32 rhead;                /* private copy of ring->head */
+        int statreq;              /* a statistics snapshot is requested */
+        struct irqflow_stats stats;   /* the snapshot, taken at an event */
+
+        /* written by the drive pin generator, maybe on another cpu */
+        struct hrtimer drive      /* drive pin generator */
+                ____cacheline_aligned_in_smp;
+        int drvval;               /* next value to be sent to drive line */
+        long dcadence;            /* ns generator half period */
+        u32 dgen;                 /* generation of the configuration in use */
+        u64 drvtime[2];           /* ns of the last toggle to 0 and to 1 */
+        u64 toggles;              /* drive pin toggles since open */
+        u64 overruns;             /* generator periods missed since open */
+
+        /* used by read(), the work queue and debugfs */
+        wait_queue_head_t queue
+                ____cacheline_aligned_in_smp;
+        struct mutex rlock;       /* one read() at a time */
+        DECLARE_KFIFO(summaries, struct irqflow_summary, NSUMMARY);
+        u32 rset;                 /* last set returned by a text read() */
+        seqcount_t lseq;          /* guards lastsum */
+        struct irqflow_summary lastsum;    /* last set closed, set 0 if none */
+        struct dentry *ddir;      /* debugfs directory of this pin */
+        struct mutex slock;       /* one snapshot read at a time */
+        DECLARE_KFIFO(anomalies, struct anomaly, NANOMALY);
+        atomic_t unreported;      /* bad events lost with the kfifo full */
+        struct work_struct report_work;
+        struct mutex clock;       /* one control ioctl at a time */
+        struct completion statdone;    /* the snapshot is taken */
+        struct rate rstart;       /* rate counters at open or reset */
+        struct rate rprev;        /* rate counters at the last count only read() */
+};
+
+/*  debug can be switched on/off with
+                      "echo 1/0 > /sys/modules/irqflow/parameters/debug"
+    - with debug off, the messages above level 0 cost a nop  */
+
+#define dbg_printk(level,frm,...) if ((level == 0 || static_branch_unlikely(&debug_key)) && debug>=level)	\
+               printk(KERN_INFO "%s:%s - " frm, HERE, ## __VA_ARGS__ )
+
+/*
+ *  ns timestamp from the selected source - counter ticks are scaled with
+ *  the mult/shift pair calibrated at load time
+ */
+
+static inline u64 timestamp (int source) {
+        switch (source) {
+        case TSRC_FAST:
+                return ktime_get_mono_fast_ns();
+        case TSRC_LOCAL:
+                return local_clock();
+        case TSRC_COUNTER:
+                return mul_u64_u32_shr (read_counter(), cnt_mult, cnt_shift);
+        default:
+                return ktime_get_ns();
+        }
+}
+
+/*
+ *  ns interval between two timestamps, clamped to what a long can hold
+ */
+
+static inline long nsec (u64 after, u64 before) {
+        u64 diff = after - before;
+
+        return diff > LONG_MAX ? LONG_MAX : diff;
+}
+
+/*
+ *  histogram bin of a value: values below 2^HIST_SUB have their own bin,
+ *  larger ones are split in 2^HIST_SUB bins per power of 2
+ */
+
+static inline int hist_bin (unsigned long v) {
+        int msb;
+
+        if (v < (1 << HIST_SUB)) return v;
+        msb = fls(v) - 1;
+        if (msb > HIST_MSB) return HBINS - 1;
+        return ((msb - HIST_SUB + 1) << HIST_SUB) |
+                ((v >> (msb - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+}
+
+/*
+ *  lowest value falling in a histogram bin
+ */
+
+static unsigned long hist_low (int bin) {
+        int msb = (bin >> HIST_SUB) + HIST_SUB - 1;
+
+        if (bin < (1 << HIST_SUB)) return bin;
+        return ((1UL << HIST_SUB) | (bin & ((1 << HIST_SUB) - 1))) << (msb - HIST_SUB);
+}
+
+/*
+ *  upper edge of the bin holding the <pcm>/100000 quantile
+ */
+
+static long hist_quantile (u32 *hist, long total, int pcm) {
+        u64 target = div_u64 ((u64) total * pcm + 99999, 100000);
+        u64 sum = 0;
+        int bin;
+
+        for ( bin=0 ; bin<HBINS-1 ; bin++ ) {
+                sum += hist[bin];
+                if (sum >= target) break;
+        }
+        return bin < HBINS-1 ? hist_low (bin+1) - 1 : hist_low (bin);
+}
+
+/*
+ *  close the histograms of a set: save the jitter quantiles,
+ *  add the set to the totals and clear for the next set
+ */
+
+static void hist_close (struct pin_data * event, struct irqflow_summary *sum) {
+        int bin;
+
+        sum->jitter[0] = hist_quantile (event->hdev, sum->events, 50000);
+        sum->jitter[1] = hist_quantile (event->hdev, sum->events, 99000);
+        sum->jitter[2] = hist_quantile (event->hdev, sum->events, 99900);
+        sum->jitter[3] = max (abs (event->imax - event->cadence),
+                              abs (event->imin - event->cadence));
+        for ( bin=0 ; bin<HBINS ; bin++ ) {
+                event->hint_all[bin] += event->hint[bin];
+                event->hdev_all[bin] += event->hdev[bin];
+        }
+        memset (event->hint, 0, sizeof(event->hint));
+        memset (event->hdev, 0, sizeof(event->hdev));
+}
+
+/*
+ *  keep the summary in the history of the pin - one writer, the
+ *  checker of the pin; the readers never block it
+ */
+
+static void history_put (struct pin_data * event, struct irqflow_summary *sum) {
+        struct set_log * log = setlogs[event->minor];
+        struct set_record * rec = &log->rec[log->head & log->mask];
+
+        smp_wmb ();                     /* the new head before the record */
+        rec->time = ktime_get_real_ns ();
+        rec->run = log->run;
+        rec->sum = *sum;
+        smp_wmb ();                     /* the record before its head */
+        WRITE_ONCE(log->head, log->head + 1);
+}
+
+/*
+ *  publish the last summary for the readers that do not consume the
+ *  queue: the only writer is the checker of the pin and never waits,
+ *  the readers retry if a new summary came while they were copying
+ */
+
+static void summary_publish (struct pin_data * event, struct irqflow_summary *sum) {
+        preempt_disable ();             /* split mode: the irq thread */
+        write_seqcount_begin (&event->lseq);
+        event->lastsum = *sum;
+        write_seqcount_end (&event->lseq);
+        preempt_enable ();
+}
+
+/*
+ *  end of a set of <setsize> events - queue the summary for read()
+ *  and restart the counters
+ */
+
+static void set_close (struct pin_data * event, u64 now) {
+        struct irqflow_summary sum = {
+                .set = ++event->nset, .pin = event->pin,
+                .events = event->count - 1, .bad = event->bad,
+                .set_time = now - event->first,
+                .imin = event->imin, .imax = event->imax,
+                .hard_avg = div_u64 (event->hardns, max (event->count - 1, 1L)),
+                .hard_max = event->hardmax,
+                .dropped = READ_ONCE(event->dropped) - event->dropseen,
+                .lat_avg = div_u64 (event->latns, max (event->count - 1, 1L)),
+                .lat_max = event->latmax,
+                .lost = event->kinds[BAD_LOST], .late = event->kinds[BAD_LATE],
+                .early = event->kinds[BAD_EARLY], .duplicate = event->kinds[BAD_DUP],
+                .missed = event->missed,
+                .track_phase = event->phmax,
+        };
+
+        if (event->tlock == TRACK_LOCK)
+                sum.track_freq = div64_u64 (1000000000000ULL << TRACK_Q, event->tperiod);
+        hist_close (event, &sum);
+        kfifo_put (&event->summaries, sum);     /* dropped if the reader is late */
+        summary_publish (event, &sum);
+        if (setlogs) history_put (event, &sum);
+        wake_up_interruptible (&event->queue);
+
+        event->dropseen += sum.dropped;
+        event->hardns = 0;
+        event->hardmax = 0;
+        event->latns = 0;
+        event->latmax = 0;
+        event->bad = 0;
+        memset (event->kinds, 0, sizeof(event->kinds));
+        event->missed = 0;
+        event->phmax = 0;
+        event->imin = LONG_MAX;
+        event->imax = 0;
+        event->first = now;
+        event->count = 1;
+}
+
+/*
+ *  log a bad event - anything but a trace event is kept out of the
+ *  interrupt routine unless explicitly requested with report=0
+ */
+
+static void report_anomaly (struct pin_data * event, int val, long nsdiff, int kind,
+                            int near, long nearns) {
+        struct anomaly a = {
+                .oldval = event->val, .val = val,
+                .nsdiff = nsdiff, .olddiff = event->nsdiff,
+                .bad = event->bad, .count = event->count, .kind = kind,
+                .near = near, .nearns = nearns,
+        };
+
+        trace_irqflow_anomaly (event->pin, event->irq, a.oldval, a.val,
+                               a.nsdiff, a.olddiff, a.bad, a.count, a.kind,
+                               a.near, a.nearns);
+
+        switch (report) {
+        case REPORT_PRINTK:
+                dbg_printk (0, "irq %d:%d - val %d -> %d after %ld / %ld us  bad ev.: %ld:%ld %s\n",
+                        event->pin, event->irq, a.oldval, a.val,
+                        a.nsdiff / 1000, a.olddiff / 1000, a.bad, a.count,
+                        bad_name[a.kind]);
+                if (a.near >= 0)
+                        dbg_printk (0, "irq %d:%d - lost edge %ld ns from an edge of pin %d\n",
+                                event->pin, event->irq, a.nearns, a.near);
+                break;
+        case REPORT_DEFER:
+                if (kfifo_put (&event->anomalies, a)) schedule_work (&event->report_work);
+                else atomic_inc (&event->unreported);
+                break;
+        }
+}
+
+/*
+ *  work queue - log the bad events queued by the interrupt routine
+ */
+
+static void report_drain (struct work_struct *work) {
+        struct pin_data * event = container_of (work, struct pin_data, report_work);
+        struct anomaly a;
+        int lost;
+
+        while (kfifo_get (&event->anomalies, &a)) {
+                dbg_printk (0, "irq %d:%d - val %d -> %d after %ld / %ld us  bad ev.: %ld:%ld %s\n",
+                        event->pin, event->irq, a.oldval, a.val,
+                        a.nsdiff / 1000, a.olddiff / 1000, a.bad, a.count,
+                        bad_name[a.kind]);
+                if (a.near >= 0)
+                        dbg_printk (0, "irq %d:%d - lost edge %ld ns from an edge of pin %d\n",
+                                event->pin, event->irq, a.nearns, a.near);
+        }
+        lost = atomic_xchg (&event->unreported, 0);
+        if (lost) dbg_printk (0, "pin %d - %d bad events not logged\n", event->pin, lost);
+}
+
+/*
+ *  append an event to the ring; never wait for the reader, drop
+ *  the event if the ring is full
+ */
+
+static inline void ring_put (struct pin_data * event, struct stamp *stamp) {
+        struct irqflow_event *slot;
+        u32 head = event->rhead;
+
+        if (head - READ_ONCE(event->ring->tail) > event->rmask) {
+                event->ring->lost++;
+                return;
+        }
+        slot = &event->revent[head & event->rmask];
+        slot->time = stamp->now;
+        slot->val = stamp->val;
+        slot->cpu = stamp->cpu;
+        event->rhead = ++head;
+        smp_store_release(&event->ring->head, head);
+}
+
+/*
+ *  account an interval to the statistics of the cpu that serviced it
+ */
+
+static inline void cpu_account (struct pin_data * event, struct stamp *stamp,
+                                long nsdiff, int bad) {
+        struct cpu_stat *cs = per_cpu_ptr (event->cpustat, stamp->cpu);
+
+        cs->count++;
+        cs->bad += bad;
+        cs->nssum += nsdiff;
+        cs->hardns += stamp->cost;
+        if (nsdiff < cs->imin || cs->count == 1) cs->imin = nsdiff;
+        if (nsdiff > cs->imax) cs->imax = nsdiff;
+        if (abs(nsdiff - event->cadence) > cs->devmax) cs->devmax = abs(nsdiff - event->cadence);
+}
+
+/*
+ *  flight recorder - keep the last events; on a bad event freeze the
+ *  <snapwin> events before it in a free snapshot, which then collects
+ *  the <snapwin> events after it. Several snapshots fill at once.
+ */
+
+static void snapshot_open (struct pin_data * event, int kind) {
+        struct snapshot * snap = NULL;
+        int j, before;
+
+        for ( j=0 ; j<NSNAP ; j++ ) {
+                if (smp_load_acquire (&event->snap[j].state) == SNAP_FREE) {
+                        snap = &event->snap[j];
+                        break;
+                }
+        }
+        if (snap == NULL) {
+                event->snaplost++;
+                return;
+        }
+
+        before = min_t (u64, event->snapwin, event->seq);
+        for ( j=0 ; j<=before ; j++ )
+                snap->ev[j] = event->flight[(event->seq - before + j) & (NFLIGHT - 1)];
+        snap->kind = kind;
+        snap->seq = event->seq;
+        snap->n = before + 1;
+        snap->first = before;
+        snap->after = event->snapwin;
+        if (snap->after) {
+                snap->state = SNAP_FILLING;
+                event->filling++;
+        } else {
+                smp_store_release (&snap->state, SNAP_READY);
+        }
+}
+
+static inline void flight_record (struct pin_data * event, struct stamp *stamp,
+                                  long nsdiff, int kind) {
+        struct flight * f = &event->flight[event->seq & (NFLIGHT - 1)];
+        struct snapshot * snap;
+        int j;
+
+        f->time = stamp->now;
+        f->nsdiff = nsdiff;
+        f->val = stamp->val;
+        f->cpu = stamp->cpu;
+
+        for ( j=0 ; event->filling && j<NSNAP ; j++ ) {
+                snap = &event->snap[j];
+                if (snap->state != SNAP_FILLING) continue;
+                snap->ev[snap->n++] = *f;
+                if (--snap->after == 0) {
+                        smp_store_release (&snap->state, SNAP_READY);
+                        event->filling--;
+                }
+        }
+
+        if (kind != BAD_NONE) snapshot_open (event, kind);
+        event->seq++;
+}
+
+/*
+ *  bank dispatch - the gpio bank interrupt runs the handlers of all
+ *  its pins with an edge in turn, on one cpu: a handler starting close
+ *  to the end of the previous one of the same bank joins its dispatch.
+ *  A dispatch is accounted when the next one starts.
+ */
+
+static inline void dispatch_enter (struct pin_data * event, struct stamp *stamp) {
+        struct dispatch * d = &this_cpu_ptr (banks)->bank[event->bank];
+        u32 wait;
+
+        if (!static_branch_likely(&dispatch_key)) return;
+        if (d->n && d->tsource == event->tsource && nsec (stamp->now, d->end) <= dispatchgap) {
+                d->n++;
+        } else {
+                if (d->n) {
+                        d->count++;
+                        d->handlers += d->n;
+                        d->size[min (d->n, NDPOS)]++;
+                        if (d->n > 1) d->span[hist_bin(nsec (d->lastin, d->first))]++;
+                }
+                d->first = stamp->now;
+                d->tsource = event->tsource;
+                d->n = 1;
+        }
+        d->lastin = stamp->now;
+
+        wait = nsec (stamp->now, d->first);
+        event->dpos[min (d->n, NDPOS) - 1]++;
+        event->dwaitns += wait;
+        if (wait > event->dwaitmax) event->dwaitmax = wait;
+}
+
+static inline void dispatch_exit (struct pin_data * event, u64 end) {
+        if (!static_branch_likely(&dispatch_key)) return;
+        this_cpu_ptr (banks)->bank[event->bank].end = end;
+}
+
+/*
+ *  cross-pin correlation - the nearest of the last edges of pin <k> to
+ *  time <t>: ns, positive if the edge is after <t>; LONG_MAX if none or
+ *  taken with another clock
+ */
+
+static long edge_nearest (struct pin_data * event, int k, u64 t) {
+        long d, best = LONG_MAX;
+        u64 e;
+        int j;
+
+        if (READ_ONCE(edges[k].tsource) != event->tsource) return LONG_MAX;
+        for ( j=0 ; j<NEDGE ; j++ ) {
+                e = atomic64_read (&edges[k].t[j]);
+                if (e == 0) continue;
+                d = clamp_t (s64, e - t, -LONG_MAX, LONG_MAX);
+                if (abs(d) < abs(best)) best = d;
+        }
+        return best;
+}
+
+/*
+ *  account the distance of this edge from the nearest edge of each
+ *  other pin; for lost edges find the pin with an edge nearest to where
+ *  the first missing edge should have been, one cadence after the last
+ *  event. Then publish this edge for the other pins.
+ */
+
+static void edge_correlate (struct pin_data * event, struct stamp *stamp, int kind,
+                            int *near, long *nearns) {
+        struct edge_log * own = &edges[event->minor];
+        u64 missing = event->last + event->cadence;
+        long d;
+        int k, nearest = -1;
+
+        *nearns = LONG_MAX;
+        *near = -1;
+        if (!static_branch_likely(&skew_key)) return;
+        for ( k=0 ; k<npins ; k++ ) {
+                if (k == event->minor) continue;
+                d = edge_nearest (event, k, stamp->now);
+                if (d != LONG_MAX) event->skew->pair[k].hist[hist_bin(abs(d))]++;
+                if (kind != BAD_LOST) continue;
+                d = edge_nearest (event, k, missing);
+                if (abs(d) < abs(*nearns)) {
+                        nearest = k;
+                        *nearns = d;
+                }
+        }
+        if (nearest >= 0) {
+                event->skew->pair[nearest].nlost++;
+                event->skew->lost[hist_bin(abs(*nearns))]++;
+                *near = pins[nearest];
+        }
+
+        atomic64_set (&own->t[own->next], stamp->now);
+        own->next = (own->next + 1) & (NEDGE - 1);
+}
+
+/*
+ *  tracking mode - the loop runs on the full period of the square wave,
+ *  so that a duty cycle other than 50% does not matter: the expected
+ *  time of the next event with the same value moves by the tracked
+ *  period and both are corrected by a fraction of the phase error.
+ *  Errors beyond the window are clipped, so a latency spike does not
+ *  pull the loop; lost edges and errors of a quarter period restart
+ *  the phase.
+ */
+
+static inline long track_error (struct pin_data * event, struct stamp *stamp) {
+        s64 err = stamp->now - event->tnext[stamp->val & 1];
+
+        if (event->tnext[stamp->val & 1] == 0) return 0;
+        return clamp_t (s64, err, -LONG_MAX, LONG_MAX);
+}
+
+static void track_update (struct pin_data * event, struct stamp *stamp, long perr, int kind) {
+        u64 *tnext = &event->tnext[stamp->val & 1];
+        long period = event->tperiod >> TRACK_Q;
+
+        if (*tnext == 0 || kind == BAD_LOST || kind == BAD_DUP || abs(perr) > period / 4) {
+                *tnext = stamp->now + period;
+                return;
+        }
+        if (event->tlock == TRACK_LOCK && abs(perr) > event->phmax) event->phmax = abs(perr);
+        else if (event->tlock < TRACK_LOCK) event->tlock++;
+        perr = clamp (perr, -event->track, event->track);
+        event->tperiod += (s64) perr * (1 << (TRACK_Q - TRACK_KI));
+        *tnext += period + (perr >> TRACK_KP);
+}
+
+/*
+ *  kind of a bad event: the line value should alternate, the interval
+ *  should be within <tolerance> from <cadence>
+ */
+
+static inline int bad_kind (struct pin_data * event, int val, long nsdiff, long perr) {
+        if (val == event->val) return nsdiff < event->tmin ? BAD_DUP : BAD_LOST;
+        if (event->tlock == TRACK_LOCK) {
+                if (perr > event->track) return BAD_LATE;
+                if (perr < -event->track) return BAD_EARLY;
+                return BAD_NONE;
+        }
+        if (nsdiff > event->tmax) return BAD_LATE;
+        if (nsdiff < event->tmin) return BAD_EARLY;
+        return BAD_NONE;
+}
+
+/*
+ *  edges hidden in an interval of about n cadences: n - 1, rounded to
+ *  the parity the line values imply - odd for a lost event (at least
+ *  one), even for a late one
+ */
+
+static inline long missed_edges (struct pin_data * event, long nsdiff, int kind) {
+        long odd = kind == BAD_LOST;
+
+        if (event->cadence <= 0) return odd;
+        return max (2 * DIV_ROUND_CLOSEST(nsdiff - (1 + odd) * event->cadence,
+                                          2 * event->cadence) + odd, odd);
+}
+
+/*
+ *  take a new configuration: cadence and tolerance from the pin
+ *  configuration or from the module parameters, tracking restarted
+ */
+
+static void config_latch (struct pin_data * event, struct pin_config * conf) {
+        long cad = conf && conf->cadence ? conf->cadence : cadence;
+        long tol = conf && conf->tolerance ? conf->tolerance : tolerance;
+
+        event->cgen = conf ? conf->gen : 0;
+        event->setsize = conf && conf->setsize ? conf->setsize : setsize;
+        event->tmax = (cad + tol) * 1000L;
+        event->tmin = (cad - tol) * 1000L;
+        event->cadence = cad * 1000L;
+        event->tperiod = (s64) event->cadence << (TRACK_Q + 1);
+        event->tnext[0] = event->tnext[1] = 0;
+        event->tlock = 0;
+}
+
+/*
+ *  counters for a statistics snapshot
+ */
+
+static void stats_fill (struct pin_data * event, struct irqflow_stats *st, u64 now) {
+        st->time = now;
+        st->events = event->total;
+        st->bad = event->totalbad;
+        st->lost = event->lost;
+        st->sets = event->nset;
+        st->set_events = max (event->count - 1, 0L);
+        st->set_bad = event->bad;
+        st->armed = !READ_ONCE(event->idle);
+}
+
+/*
+ *  check an event against the flow - the stamp cost is the ns spent
+ *  in the interrupt routine to be accounted to the set
+ */
+
+static void check_event (struct pin_data * event, struct stamp *stamp) {
+        struct pin_config * conf;
+        long nsdiff, perr, nearns;
+        int val = stamp->val;
+        int bad, kind, near;
+
+        nsdiff = nsec (stamp->now, event->last);
+        if (event->ring) ring_put (event, stamp);
+        trace_irqflow_event (event->pin, val, nsdiff, event->count);
+
+        /* a new configuration: close the set, the event starts the next one */
+
+        rcu_read_lock ();
+        conf = rcu_dereference (pconf[event->minor]);
+        if ((conf ? conf->gen : 0) != event->cgen) {
+                if (event->count > 1) set_close (event, stamp->now);   /* not an empty set */
+                config_latch (event, conf);
+                event->count = 0;
+        }
+        rcu_read_unlock ();
+
+        /* verify the event - an interval of n cadences hides n - 1
+           edges, also with the line at the expected value (late) */
+
+        perr = event->track ? track_error (event, stamp) : 0;
+        kind = event->count > 0 ? bad_kind (event, val, nsdiff, perr) : BAD_NONE;
+        bad = kind != BAD_NONE;
+        if (event->snap) flight_record (event, stamp, nsdiff, kind);
+        edge_correlate (event, stamp, kind, &near, &nearns);
+        if (bad) {
+                event->bad++;
+                event->kinds[kind]++;
+                if (kind == BAD_LOST) {
+                        event->missed += missed_edges (event, nsdiff, kind);
+                        event->lost++;
+                }
+                if (kind == BAD_LATE) event->missed += missed_edges (event, nsdiff, kind);
+                report_anomaly (event, val, nsdiff, kind, near, nearns);
+        }
+
+        if (event->count > 0) {
+                event->hint[hist_bin(nsdiff)]++;
+                event->hdev[hist_bin(abs(nsdiff - event->cadence))]++;
+                if (event->track) track_update (event, stamp, perr, kind);
+                if (nsdiff < event->imin) event->imin = nsdiff;
+                if (nsdiff > event->imax) event->imax = nsdiff;
+                if (nsdiff < event->amin) WRITE_ONCE(event->amin, nsdiff);
+                if (nsdiff > event->amax) WRITE_ONCE(event->amax, nsdiff);
+                event->hardns += stamp->cost;
+                if (stamp->cost > event->hardmax) event->hardmax = stamp->cost;
+                if (event->dgpio) {
+                        event->latns += stamp->lat;
+                        if (stamp->lat > event->latmax) event->latmax = stamp->lat;
+                        event->hlat_all[hist_bin(stamp->lat)]++;
+                }
+                cpu_account (event, stamp, nsdiff, bad);
+                event->total++;
+                event->totalbad += bad;
+        }
+
+        /* end of a set of <setsize> events - save results for read() */
+
+        if (event->count == 0) event->first = stamp->now;
+        if (event->count++ >= event->setsize)
+                set_close (event, stamp->now);
+
+        /* save current event values */
+
+        event->val = val;
+        event->nsdiff = nsdiff;
+        event->last = stamp->now;
+
+        /* statistics snapshot requested by ioctl - taken here, by the
+           only writer, so that it is consistent */
+
+        if (unlikely(READ_ONCE(event->statreq)) && xchg (&event->statreq, 0)) {
+                stats_fill (event, &event->stats, stamp->now);
+                complete (&event->statdone);
+        }
+}
+
+/*
+ *  set the drive pin - the toggle time is saved before the line is
+ *  set, so it is there when the interrupt routine looks for it
+ */
+
+static inline void drive_set (struct pin_data * event, int val) {
+        WRITE_ONCE(event->drvtime[val], timestamp (event->tsource));
+        smp_wmb();
+        gpiod_set_value (event->dgpio, val);
+        event->toggles++;
+}
+
+/*
+ *  half period of the generator, following the pin configuration
+ */
+
+static inline long drive_period (struct pin_data * event) {
+        struct pin_config * conf;
+
+        rcu_read_lock ();
+        conf = rcu_dereference (pconf[event->minor]);
+        if ((conf ? conf->gen : 0) != event->dgen) {
+                event->dgen = conf ? conf->gen : 0;
+                event->dcadence = (conf && conf->cadence ? conf->cadence : cadence) * 1000L;
+        }
+        rcu_read_unlock ();
+
+        return event->dcadence;
+}
+
+/*
+ *  drive pin generator
+ */
+
+static enum hrtimer_restart drive_toggle (struct hrtimer *timer) {
+        struct pin_data * event = container_of (timer, struct pin_data, drive);
+        u64 overrun;
+
+        drive_set (event, event->drvval);
+        event->drvval ^= 1;
+
+        overrun = hrtimer_forward_now (timer, ns_to_ktime (drive_period (event)));
+        if (overrun > 1) event->overruns += overrun - 1;
+
+        return HRTIMER_RESTART;
+}
+
+/*
+ *  ns from the toggle that brought the line to the value just read;
+ *  the toggle to the same value before is two cadences older
+ */
+
+static inline u32 drive_latency (struct pin_data * event, struct stamp *stamp) {
+        smp_rmb();
+        return nsec (stamp->now, READ_ONCE(event->drvtime[stamp->val & 1]));
+}
+
+/*
+ *    interrupt service routine
+ */
+
+#define Event ((struct pin_data *) arg)
+
+irqreturn_t irq_service(int irq, void * arg) {
+        struct stamp stamp;
+        u64 end;
+
+        if (READ_ONCE(Event->idle)) return IRQ_HANDLED;
+
+        stamp.now = timestamp (Event->tsource);
+        stamp.val = gpiod_get_value(Event->gpio);
+        stamp.cpu = raw_smp_processor_id();
+        dispatch_enter (Event, &stamp);
+        stamp.lat = Event->dgpio ? drive_latency (Event, &stamp) : 0;
+
+        /* the cost of this call is known at the end: account the previous one */
+
+        stamp.cost = Event->hcost;
+        check_event (Event, &stamp);
+        end = timestamp (Event->tsource);
+        Event->hcost = end - stamp.now;
+        dispatch_exit (Event, end);
+
+        return IRQ_HANDLED;
+}
+
+/*
+ *    split mode - the interrupt routine only takes time and value,
+ *                 the irq thread checks them
+ */
+
+irqreturn_t irq_stamp(int irq, void * arg) {
+        struct stamp stamp;
+        u64 end;
+
+        if (READ_ONCE(Event->idle)) return IRQ_HANDLED;
+
+        stamp.now = timestamp (Event->tsource);
+        stamp.val = gpiod_get_value(Event->gpio);
+        stamp.cpu = raw_smp_processor_id();
+        dispatch_enter (Event, &stamp);
+        stamp.lat = Event->dgpio ? drive_latency (Event, &stamp) : 0;
+        end = timestamp (Event->tsource);
+        stamp.cost = end - stamp.now;
+        dispatch_exit (Event, end);
+        if (!kfifo_put (&Event->stamps, stamp)) {
+                Event->dropped++;
+                return IRQ_HANDLED;
+        }
+
+        return IRQ_WAKE_THREAD;
+}
+
+irqreturn_t irq_verify(int irq, void * arg) {
+        struct stamp stamp;
+
+        while (kfifo_get (&Event->stamps, &stamp))
+                check_event (Event, &stamp);
+
+        return IRQ_HANDLED;
+}
+
+/*
+ *    count only mode - the least an interrupt routine can do, to measure
+ *                      the ceiling of the gpio interrupt path; timed
+ *                      as irq_service(), from entry to exit with the
+ *                      clock of the pin, the cost accounted at the next
+ *                      event
+ */
+
+irqreturn_t irq_count(int irq, void * arg) {
+        struct cpu_stat *cs;
+        u64 now;
+
+        if (READ_ONCE(Event->idle)) return IRQ_HANDLED;
+
+        now = timestamp (Event->tsource);
+        cs = this_cpu_ptr (Event->cpustat);
+        cs->count++;
+        cs->hardns += Event->hcost;
+        Event->hcost = timestamp (Event->tsource) - now;
+
+        return IRQ_HANDLED;
+}
+
+/*
+ *  interrupt rate - the same figures for the checker and the count only
+ *  routine: events per second, time in the routine and, with a drive
+ *  pin, the edges the routine never saw
+ */
+
+static void rate_take (struct pin_data * event, struct rate *r) {
+        struct cpu_stat *cs;
+        int cpu;
+
+        r->time = ktime_get_ns ();
+        r->events = r->hardns = 0;
+        for_each_possible_cpu (cpu) {
+                cs = per_cpu_ptr (event->cpustat, cpu);
+                r->events += READ_ONCE(cs->count);
+                r->hardns += READ_ONCE(cs->hardns);
+        }
+        r->toggles = READ_ONCE(event->toggles);
+}
+
+static int rate_format (char *stat, int size, struct pin_data * event,
+                        struct rate *now, struct rate *from) {
+        u64 events = now->events - from->events;
+        u64 ns = max (now->time - from->time, 1ULL);
+        int leng;
+
+        leng = scnprintf (stat, size, "%s on pin %u: %llu events in %llu usec, %llu Hz."
+                          " Hard irq avg: %llu ns",
+                          event->countonly ? "Count only" : "Checker", event->pin,
+                          events, div_u64 (ns, 1000), div64_u64 (events * NSEC_PER_SEC, ns),
+                          div64_u64 (now->hardns - from->hardns, max (events, 1ULL)));
+        if (event->dgpio)
+                leng += scnprintf (stat + leng, size - leng, " Toggles: %llu Not serviced: %lld",
+                                   now->toggles - from->toggles,
+                                   (s64) (now->toggles - from->toggles - events));
+        leng += scnprintf (stat + leng, size - leng, "\n");
+
+        return leng;
+}
+
+/*
+ *  read() in count only mode - one rate line every second
+ */
+
+static ssize_t count_read (struct file *filp, char *buf, size_t count) {
+        struct pin_data * event = filp->private_data;
+        struct rate now;
+        char stat[240];
+        int leng;
+
+        if (mutex_lock_interruptible (&event->rlock)) return -ERESTARTSYS;
+        if (!(filp->f_flags & O_NONBLOCK) && msleep_interruptible (1000)) {
+                mutex_unlock (&event->rlock);
+                return -ERESTARTSYS;
+        }
+        rate_take (event, &now);
+        leng = min_t(size_t, rate_format (stat, sizeof(stat), event, &now, &event->rprev), count);
+        event->rprev = now;
+        mutex_unlock (&event->rlock);
+
+        if (copy_to_user (buf, stat, leng)) return -EFAULT;
+        return leng;
+}
+
+/*
+ *  text line of a set summary
+ */
+
+static int format_summary (char *stat, int size, struct irqflow_summary *sum) {
+        int leng;
+
+        leng = scnprintf (stat, size, "Events: %u in %llu usec on pin %u. Bad events: %u"
+                          " Jitter p50/p99/p99.9/max: %u/%u/%u/%u ns Hard irq avg/max: %u/%u ns",
+                          sum->events, div_u64 (sum->set_time, 1000), sum->pin, sum->bad,
+                          sum->jitter[0], sum->jitter[1], sum->jitter[2], sum->jitter[3],
+                          sum->hard_avg, sum->hard_max);
+        if (sum->dropped)
+                leng += scnprintf (stat + leng, size - leng, " Unchecked: %u", sum->dropped);
+        if (sum->bad)
+                leng += scnprintf (stat + leng, size - leng,
+                                   " Lost/late/early/duplicate: %u/%u/%u/%u Missed edges: %u",
+                                   sum->lost, sum->late, sum->early, sum->duplicate, sum->missed);
+        if (sum->track_freq)
+                leng += scnprintf (stat + leng, size - leng, " Tracked: %u.%03u Hz phase max %u ns",
+                                   sum->track_freq / 1000, sum->track_freq % 1000, sum->track_phase);
+        if (sum->lat_max)
+                leng += scnprintf (stat + leng, size - leng, " Latency avg/max: %u/%u ns",
+                                   sum->lat_avg, sum->lat_max);
+        leng += scnprintf (stat + leng, size - leng, "\n");
+
+        return leng;
+}
+
+/*
+ *    read - wait for at least one set summary, then return as many
+ *           queued summaries as fit in the buffer
+ */
+
+ssize_t read (struct file *filp, char *buf,
+              const size_t count, loff_t *ppos) {
+
+        struct pin_data * events = filp->private_data;
+        struct irqflow_summary sum;
+        unsigned int copied;
+        int retval;
+        char stat[240];
+        int leng;
+        ssize_t done = 0;
+
+        if (events->countonly) return count_read (filp, buf, count);
+        if (events->binary && count < sizeof(sum)) return -EINVAL;
+
+        if (mutex_lock_interruptible (&events->rlock)) return -ERESTARTSYS;
+        while (kfifo_is_empty (&events->summaries)) {
+                mutex_unlock (&events->rlock);
+                if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+                retval = wait_event_interruptible (events->queue,
+                                             !kfifo_is_empty (&events->summaries));
+                if (retval) return -ERESTARTSYS;
+                if (mutex_lock_interruptible (&events->rlock)) return -ERESTARTSYS;
+        }
+
+        if (events->binary) {
+                retval = kfifo_to_user (&events->summaries, buf, count, &copied);
+                mutex_unlock (&events->rlock);
+                return retval ? retval : copied;
+        }
+
+        while (kfifo_peek (&events->summaries, &sum)) {
+                leng = 0;
+                if (sum.set != events->rset + 1)
+                        leng = scnprintf (stat, 240, "Lost %u summaries on pin %u\n",
+                                          sum.set - events->rset - 1, sum.pin);
+                leng += format_summary (stat + leng, 240 - leng, &sum);
+                if (done + leng > count) {
+                        if (done) break;
+                        leng = count;     /* tiny buffer: truncate the line */
+                }
+                if (copy_to_user (buf + done, stat, leng)) {
+                        if (!done) done = -EFAULT;
+                        break;
+                }
+                kfifo_skip (&events->summaries);
+                events->rset = sum.set;
+                done += leng;
+        }
+        mutex_unlock (&events->rlock);
+
+        return done;
+}
+
+/*
+ *    poll - readable when a set summary is queued
+ */
+
+__poll_t poll (struct file *filp, poll_table *wait) {
+        struct pin_data * events = filp->private_data;
+
+        poll_wait (filp, &events->queue, wait);
+
+        return kfifo_is_empty (&events->summaries) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+/*
+ *    session control - the interrupt stays registered, the checks are
+ *                      switched off and on around the counter reset
+ */
+
+static void session_disarm (struct pin_data * event) {
+        WRITE_ONCE(event->idle, 1);
+        synchronize_irq (event->irq);   /* the interrupt routines are done */
+}
+
+static void session_arm (struct pin_data * event) {
+        event->count = 0;               /* the next event starts a set, unchecked */
+        event->tnext[0] = event->tnext[1] = 0;
+        event->tlock = 0;
+        smp_store_release (&event->idle, 0);
+}
+
+static void session_reset (struct pin_data * event) {
+        int cpu;
+
+        event->bad = 0;
+        event->total = event->totalbad = event->lost = 0;
+        memset (event->kinds, 0, sizeof(event->kinds));
+        event->missed = 0;
+        event->imin = event->amin = LONG_MAX;
+        event->imax = event->amax = 0;
+        event->hardns = event->latns = 0;
+        event->hardmax = event->latmax = 0;
+        event->phmax = 0;
+        event->dropseen = READ_ONCE(event->dropped);
+        memset (event->dpos, 0, sizeof(event->dpos));
+        event->dwaitns = 0;
+        event->dwaitmax = 0;
+        memset (event->hint, 0, sizeof(event->hint));
+        memset (event->hdev, 0, sizeof(event->hdev));
+        memset (event->hint_all, 0, sizeof(event->hint_all));
+        memset (event->hdev_all, 0, sizeof(event->hdev_all));
+        memset (event->hlat_all, 0, sizeof(event->hlat_all));
+        memset (event->skew, 0, struct_size (event->skew, pair, npins));
+        for_each_possible_cpu (cpu)
+                memset (per_cpu_ptr (event->cpustat, cpu), 0, sizeof(struct cpu_stat));
+        kfifo_reset (&event->stamps);
+
+        mutex_lock (&event->rlock);
+        kfifo_reset (&event->summaries);
+        event->nset = event->rset = 0;
+        rate_take (event, &event->rstart);
+        event->rprev = event->rstart;
+        mutex_unlock (&event->rlock);
+        summary_publish (event, &(struct irqflow_summary) { .pin = event->pin });
+}
+
+/*
+ *  statistics snapshot - taken by the checker at the next event; if
+ *  none comes within STAT_WAIT ms, or disarmed, nothing is changing
+ *  and the counters are copied here
+ */
+
+static void session_stats (struct pin_data * event, struct irqflow_stats *st) {
+        if (!READ_ONCE(event->idle)) {
+                reinit_completion (&event->statdone);
+                smp_store_release (&event->statreq, 1);
+                if (wait_for_completion_timeout (&event->statdone,
+                                                 msecs_to_jiffies (STAT_WAIT))) {
+                        *st = event->stats;                       /* taken */
+                        return;
+                }
+                if (xchg (&event->statreq, 0) == 0) {
+                        wait_for_completion (&event->statdone);   /* being taken */
+                        *st = event->stats;
+                        return;
+                }
+        }
+        stats_fill (event, st, timestamp (event->tsource));
+}
+
+/*
+ *    ioctl - arm, disarm, reset, statistics snapshot
+ */
+
+long ioctl (struct file *filp, unsigned int cmd, unsigned long arg) {
+        struct pin_data * event = filp->private_data;
+        struct irqflow_stats st;
+        long retval = 0;
+        int armed;
+
+        if (mutex_lock_interruptible (&event->clock)) return -ERESTARTSYS;
+        armed = !event->idle;
+
+        switch (cmd) {
+        case IRQFLOW_ARM:
+                if (!armed) session_arm (event);
+                break;
+        case IRQFLOW_DISARM:
+                if (armed) session_disarm (event);
+                break;
+        case IRQFLOW_RESET:
+                if (armed) session_disarm (event);
+                session_reset (event);
+                if (armed) session_arm (event);
+                break;
+        case IRQFLOW_STATS:
+                session_stats (event, &st);
+                if (copy_to_user ((void __user *) arg, &st, sizeof(st))) retval = -EFAULT;
+                break;
+        default:
+                retval = -ENOTTY;
+        }
+        mutex_unlock (&event->clock);
+        dbg_printk (1, "pin %d - ioctl %x: %ld\n", event->pin, cmd, retval);
+
+        return retval;
+}
+
+/*
+ *    mmap - map the event ring: control page first, then the slots
+ */
+
+int mmap (struct file *filp, struct vm_area_struct *vma) {
+        struct pin_data * event = filp->private_data;
+
+        if (event->ring == NULL) return -ENODEV;
+        if (vma->vm_pgoff) return -EINVAL;
+
+        return remap_vmalloc_range (vma, event->ring, 0);
+}
+
+/*
+ *    debugfs hist - interval and deviation histograms since open
+ */
+
+static int hist_show (struct seq_file *s, void *unused) {
+        struct pin_data * event = s->private;
+        int bin;
+
+        seq_printf (s, "# pin %d - cadence %ld ns\n", event->pin, event->cadence);
+        if (event->drvpin)
+                seq_printf (s, "# drive pin %d - %llu toggles, %llu periods missed\n",
+                            event->drvpin, event->toggles, event->overruns);
+        seq_printf (s, "# from_ns     intervals    deviations     latencies\n");
+        for ( bin=0 ; bin<HBINS ; bin++ ) {
+                if (event->hint_all[bin] == 0 && event->hdev_all[bin] == 0 &&
+                    event->hlat_all[bin] == 0) continue;
+                seq_printf (s, "%9lu %13u %13u %13u\n", hist_low (bin),
+                            event->hint_all[bin], event->hdev_all[bin], event->hlat_all[bin]);
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hist);
+
+/*
+ *    debugfs summary - the last set closed, without taking it from
+ *                      the queue of read()
+ */
+
+static int summary_show (struct seq_file *s, void *unused) {
+        struct pin_data * event = s->private;
+        struct irqflow_summary sum;
+        char stat[240];
+        unsigned int seq;
+
+        do {
+                seq = read_seqcount_begin (&event->lseq);
+                sum = event->lastsum;
+        } while (read_seqcount_retry (&event->lseq, seq));
+
+        if (sum.set == 0) return 0;
+        format_summary (stat, sizeof(stat), &sum);
+        seq_printf (s, "Set %u: %s", sum.set, stat);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(summary);
+
+/*
+ *    debugfs history/pin<n> - the summaries kept since load, oldest first
+ */
+
+static int history_show (struct seq_file *s, void *unused) {
+        struct set_log * log = s->private;
+        struct set_record rec;
+        char stat[240];
+        u32 head, j, usec;
+        u64 sec;
+
+        head = READ_ONCE(log->head);
+        smp_rmb ();
+        for ( j = head - min (head, log->mask + 1) ; j != head ; j++ ) {
+                rec = log->rec[j & log->mask];
+                smp_rmb ();
+                if (READ_ONCE(log->head) - j > log->mask) continue;    /* overwritten */
+                format_summary (stat, sizeof(stat), &rec.sum);
+                sec = div_u64_rem (rec.time, NSEC_PER_SEC, &usec);
+                seq_printf (s, "%llu.%06u run %u set %u: %s", sec, usec / 1000,
+                            rec.run, rec.sum.set, stat);
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(history);
+
+/*
+ *    debugfs rate - interrupt rate and cost since open or reset
+ */
+
+static int rate_show (struct seq_file *s, void *unused) {
+        struct pin_data * event = s->private;
+        struct rate now;
+        char stat[240];
+
+        rate_take (event, &now);
+        rate_format (stat, sizeof(stat), event, &now, &event->rstart);
+        seq_puts (s, stat);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(rate);
+
+/*
+ *    debugfs cpus - per cpu statistics since open
+ */
+
+static int cpus_show (struct seq_file *s, void *unused) {
+        struct pin_data * event = s->private;
+        struct cpu_stat *cs;
+        int cpu;
+
+        seq_printf (s, "# pin %d - irq %d bound to cpu %d\n", event->pin, event->irq, event->cpu);
+        seq_printf (s, "# cpu       events   bad   min_ns   avg_ns   max_ns   maxdev_ns\n");
+        for_each_possible_cpu (cpu) {
+                cs = per_cpu_ptr (event->cpustat, cpu);
+                if (cs->count == 0) continue;
+                seq_printf (s, "%5d %12llu %5llu %8ld %8llu %8ld %11ld\n", cpu, cs->count, cs->bad,
+                            cs->imin, div64_u64 (cs->nssum, cs->count), cs->imax, cs->devmax);
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cpus);
+
+/*
+ *    debugfs skew - ns from the nearest edge of each other pin and from
+ *                   the lost edges to the nearest edge of any pin
+ */
+
+static int skew_show (struct seq_file *s, void *unused) {
+        struct pin_data * event = s->private;
+        struct skew_hist * sk = event->skew;
+        int bin, k, any;
+
+        seq_printf (s, "# pin %d - lost edges nearest to pin", event->pin);
+        for ( k=0 ; k<npins ; k++ )
+                if (k != event->minor) seq_printf (s, " %d: %u", pins[k], sk->pair[k].nlost);
+        seq_printf (s, "\n# from_ns");
+        for ( k=0 ; k<npins ; k++ )
+                if (k != event->minor) seq_printf (s, "     pin%-3d", pins[k]);
+        seq_printf (s, "       lost\n");
+        for ( bin=0 ; bin<HBINS ; bin++ ) {
+                any = sk->lost[bin];
+                for ( k=0 ; k<npins ; k++ ) any |= sk->pair[k].hist[bin];
+                if (any == 0) continue;
+                seq_printf (s, "%9lu", hist_low (bin));
+                for ( k=0 ; k<npins ; k++ )
+                        if (k != event->minor) seq_printf (s, " %10u", sk->pair[k].hist[bin]);
+                seq_printf (s, " %10u\n", sk->lost[bin]);
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(skew);
+
+/*
+ *    debugfs dispatch - position of the pin handlers in the dispatches
+ *                       of their gpio bank interrupt
+ */
 
-/* user parameters */
+static int dispatch_show (struct seq_file *s, void *unused) {
+        struct pin_data * event = s->private;
+        u64 handlers = 0;
+        int j;
+
+        for ( j=0 ; j<NDPOS ; j++ ) handlers += event->dpos[j];
+        seq_printf (s, "# pin %d - bank %d, wait from the dispatch start avg/max: %llu/%u ns\n",
+                    event->pin, event->bank,
+                    handlers ? div64_u64 (event->dwaitns, handlers) : 0, event->dwaitmax);
+        seq_printf (s, "# position     handlers\n");
+        for ( j=0 ; j<NDPOS ; j++ )
+                if (event->dpos[j]) seq_printf (s, "%10d %12u\n", j + 1, event->dpos[j]);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dispatch);
 
-static int debug = 0;
-module_param (debug, int, S_IRUGO | S_IWUSR);
-static int setsize = 10000;
-module_param (setsize, int, S_IRUGO | S_IWUSR);
-static int cadence = 500;
-module_param (cadence, int, S_IRUGO | S_IWUSR);
-static int tolerance = 100;
-module_param (tolerance, int, S_IRUGO | S_IWUSR);
+/*
+ *    debugfs banks - dispatches of each gpio bank interrupt by number of
+ *                    handlers, and ns from the first to the last handler
+ */
 
-/* global variables */
+static int banks_show (struct seq_file *s, void *unused) {
+        struct dispatch * d;
+        u64 count, handlers;
+        u32 sum[NBANK];
+        int b, j, bin, cpu;
+
+        seq_printf (s, "# dispatch gap %d ns\n# bank   dispatches     handlers", dispatchgap);
+        for ( j=1 ; j<NDPOS ; j++ ) seq_printf (s, " %9dh", j);
+        seq_printf (s, " %8d+h", NDPOS);
+        seq_printf (s, "\n");
+        for ( b=0 ; b<NBANK ; b++ ) {
+                count = handlers = 0;
+                for_each_possible_cpu (cpu) {
+                        d = &per_cpu_ptr (banks, cpu)->bank[b];
+                        count += d->count;
+                        handlers += d->handlers;
+                }
+                if (count == 0) continue;
+                seq_printf (s, "%6d %12llu %12llu", b, count, handlers);
+                for ( j=1 ; j<=NDPOS ; j++ ) {
+                        sum[0] = 0;
+                        for_each_possible_cpu (cpu)
+                                sum[0] += per_cpu_ptr (banks, cpu)->bank[b].size[j];
+                        seq_printf (s, " %10u", sum[0]);
+                }
+                seq_printf (s, "\n");
+        }
 
-static dev_t device=0;                 /* base device number */
-static struct cdev cdev;
-static int cdev_flag=0;
-static struct class * dev_class=NULL;
-static struct device * dev_device[MAXPIN];
+        seq_printf (s, "# span_from_ns");
+        for ( b=0 ; b<NBANK ; b++ ) seq_printf (s, "      bank%d", b);
+        seq_printf (s, "\n");
+        for ( bin=0 ; bin<HBINS ; bin++ ) {
+                for ( b=0 ; b<NBANK ; b++ ) {
+                        sum[b] = 0;
+                        for_each_possible_cpu (cpu)
+                                sum[b] += per_cpu_ptr (banks, cpu)->bank[b].span[bin];
+                }
+                if ((sum[0] | sum[1] | sum[2]) == 0) continue;
+                seq_printf (s, "%13lu %10u %10u %10u\n", hist_low (bin), sum[0], sum[1], sum[2]);
+        }
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(banks);
 
-/* default interrupt pin is #21; up to 8 pins can be declared
-                      at load time with pins=<pin0>,<pin1>, .... ,<pin7> */
+/*
+ *    debugfs snapshot - each read returns the oldest ready snapshot
+ *                       and frees it; end of file when none is ready
+ */
 
-static int npins=2;
-static ushort pins[MAXPIN]={16,21};
-module_param_array (pins, ushort, &npins, S_IRUGO);
+static ssize_t snapshot_read (struct file *filp, char __user *buf,
+                              size_t count, loff_t *ppos) {
+        struct pin_data * event = filp->private_data;
+        struct snapshot * snap = NULL;
+        struct flight * f;
+        char *text;
+        int j, leng;
+        ssize_t done;
+
+        if (event->snap == NULL) return 0;
+        if (mutex_lock_interruptible (&event->slock)) return -ERESTARTSYS;
+
+        for ( j=0 ; j<NSNAP ; j++ ) {
+                if (smp_load_acquire (&event->snap[j].state) != SNAP_READY) continue;
+                if (snap == NULL || event->snap[j].seq < snap->seq) snap = &event->snap[j];
+        }
+        if (snap == NULL) {
+                mutex_unlock (&event->slock);
+                return 0;
+        }
 
-struct pin_data {
-        int irq;                  /* irq number associated with gpio line */
-        int pin;                  /* gpio line number */
-        wait_queue_head_t queue;
-        struct gpio_desc *gpio;   /* gpio descriptor associated to gpio line */
-        struct timespec64 last;   /* last interrupt time */
-        struct timespec64 first;  /* first interrupt time of the set */
-        long count, bad, savebad; /* events and bad events count */
-        int val;                  /* last line value */
-        long usdiff;              /* last time interval */
-        long set_time;            /* us lenght of the set */
-        int idle;                 /* do nothing with interrupts */ 
-        int done;                 /* processed a set of <setsize> interrupts */
-        int setsize;              /* wake-up read() after so many interrupts */
-        long tmax, tmin;          /* time limits of interrupt interval */
-};
+        text = kmalloc (PAGE_SIZE, GFP_KERNEL);
+        if (text == NULL) {
+                mutex_unlock (&event->slock);
+                return -ENOMEM;
+        }
+        leng = scnprintf (text, PAGE_SIZE, "# pin %d - %s event %llu - %u bad events"
+                          " not recorded\n# %-18s %12s %4s %4s\n", event->pin,
+                          bad_name[snap->kind], snap->seq, event->snaplost,
+                          "time_ns", "interval_ns", "val", "cpu");
+        for ( j=0 ; j<snap->n ; j++ ) {
+                f = &snap->ev[j];
+                leng += scnprintf (text + leng, PAGE_SIZE - leng, "%c %18llu %12ld %4d %4d\n",
+                                   j == snap->first ? '*' : ' ', f->time, f->nsdiff,
+                                   f->val, f->cpu);
+        }
 
-/*  debug can be switched on/off with
-                      "echo 1/0 > /sys/modules/irqflow/parameters/debug"  */
+        if (count < leng) {
+                done = -EINVAL;       /* a snapshot is read in one go */
+        } else if (copy_to_user (buf, text, leng)) {
+                done = -EFAULT;
+        } else {
+                smp_store_release (&snap->state, SNAP_FREE);
+                done = leng;
+        }
+        kfree (text);
+        mutex_unlock (&event->slock);
 
-#define dbg_printk(level,frm,...) if (debug>=level)	\
-               printk(KERN_INFO "%s:%s - " frm, HERE, ## __VA_ARGS__ )
+        return done;
+}
+
+static const struct file_operations snapshot_fops = {
+        .owner = THIS_MODULE,
+        .open = simple_open,
+        .read = snapshot_read,
+};
 
 /*
- *  compute microsec time difference between two timespec64 times
+ *    debugfs clocks - cost per call and resolution of each timestamp
+ *                     source, measured with interrupts off
  */
 
-inline long usec(struct timespec64 after, struct timespec64 before) {
-        long udiff;
-        struct timespec64 diff;
-        diff = timespec64_sub(after, before);
-        udiff = diff.tv_nsec/1000 + diff.tv_sec*1000000;
-        return udiff;
+static int clocks_show (struct seq_file *s, void *unused) {
+        unsigned long flags;
+        u64 t0, t1, prev, now, res;
+        u32 cents;
+        int source, j;
+
+        seq_printf (s, "# %d calls per source - arch counter %u Hz\n", NBENCH, cnt_freq);
+        seq_printf (s, "# source        ns/call  resolution_ns\n");
+        for ( source=0 ; source<NTSRC ; source++ ) {
+                if (source == TSRC_COUNTER && cnt_freq == 0) {
+                        seq_printf (s, "%-12s  not available\n", tsrc_name[source]);
+                        continue;
+                }
+                res = ULLONG_MAX;
+                local_irq_save (flags);
+                t0 = ktime_get_ns();
+                prev = timestamp (source);
+                for ( j=0 ; j<NBENCH ; j++ ) {
+                        now = timestamp (source);
+                        if (now != prev && now - prev < res) res = now - prev;
+                        prev = now;
+                }
+                t1 = ktime_get_ns();
+                local_irq_restore (flags);
+                t1 = div_u64 ((t1 - t0) * 100, NBENCH + 1);
+                t1 = div_u64_rem (t1, 100, &cents);
+                seq_printf (s, "%-12s %8llu.%02u %14llu\n", tsrc_name[source],
+                            t1, cents, res);
+        }
+        return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(clocks);
 
 /*
- *    interrupt service routine
+ *    sysfs - per pin cadence, tolerance and setsize; 0 for the module
+ *            parameter. A new configuration is published as a whole.
  */
 
-#define Event ((struct pin_data *) arg)
-
-irqreturn_t irq_service(int irq, void * arg) {
+static ssize_t conf_show (struct device *dev, char *buf, size_t field) {
+        struct pin_config * conf;
         int val;
-        long usdiff;
-        struct timespec64 now;
 
-        if (Event->idle) return IRQ_HANDLED;
+        rcu_read_lock ();
+        conf = rcu_dereference (pconf[MINOR(dev->devt) - BASE_MINOR]);
+        val = conf ? *(int *) ((char *) conf + field) : 0;
+        rcu_read_unlock ();
 
-        ktime_get_ts64 (&now);
-        val = gpiod_get_value(Event->gpio);
-        usdiff = usec (now, Event->last); 
+        return sysfs_emit (buf, "%d\n", val);
+}
 
-        /* verify the event */
+static ssize_t conf_store (struct device *dev, const char *buf, size_t count, size_t field) {
+        struct pin_config __rcu ** slot = &pconf[MINOR(dev->devt) - BASE_MINOR];
+        struct pin_config *old, *new;
+        int val;
 
-        if (Event->count > 0 &&
-                        (val == Event->val || usdiff > Event->tmax || usdiff < Event->tmin)) {
-                Event->bad++;
-                dbg_printk (0, "irq %d:%d - val %d -> %d after %ld / %ld us  bad ev.: %ld:%ld\n",
-                        Event->pin, Event->irq, Event->val, val,
-                        usdiff, Event->usdiff, Event->bad, Event->count);
+        if (kstrtoint (buf, 0, &val) || val < 0) return -EINVAL;
+        new = kzalloc (sizeof(struct pin_config), GFP_KERNEL);
+        if (new == NULL) return -ENOMEM;
+
+        mutex_lock (&conf_lock);
+        old = rcu_dereference_protected (*slot, lockdep_is_held (&conf_lock));
+        if (old) *new = *old;
+        *(int *) ((char *) new + field) = val;
+        if ((new->cadence ? new->cadence : cadence) <=
+            (new->tolerance ? new->tolerance : tolerance)) {
+                mutex_unlock (&conf_lock);
+                kfree (new);
+                return -EINVAL;
         }
+        new->gen = ++conf_gen;
+        rcu_assign_pointer (*slot, new);
+        mutex_unlock (&conf_lock);
+        if (old) kfree_rcu (old, rcu);
 
-        /* end of a set of <setsize> events - save results for read() */
+        return count;
+}
 
-        if (Event->count == 0) Event->first = now;
-        if (Event->count++ == setsize) {
-                Event->done = 1;
-                Event->savebad = Event->bad;
-                Event->bad = 0;
-                Event->set_time = usec(now, Event->first);
-                Event->first = now;
-                Event->count = 1;
-                wake_up_interruptible(&Event->queue);
-        }
+#define CONF_ATTR(name)                                                         \
+static ssize_t name##_show (struct device *dev, struct device_attribute *attr,  \
+                            char *buf) {                                        \
+        return conf_show (dev, buf, offsetof (struct pin_config, name));        \
+}                                                                               \
+static ssize_t name##_store (struct device *dev, struct device_attribute *attr, \
+                             const char *buf, size_t count) {                   \
+        return conf_store (dev, buf, count, offsetof (struct pin_config, name));\
+}                                                                               \
+static DEVICE_ATTR_RW(name)
+
+CONF_ATTR(cadence);
+CONF_ATTR(tolerance);
+CONF_ATTR(setsize);
 
-        /* save current event values */
+/*
+ *    sysfs live/ - counters of the open pin, read on the fly without
+ *                  waiting for the end of a set nor taking anything from
+ *                  read(); -ENODEV when the pin is not open. Each value
+ *                  is read as such, the set is not taken at one event
+ *                  (ioctl STATS gives that).
+ */
 
-        Event->val = val;
-        Event->usdiff = usdiff;
-        Event->last = now;
+enum live_field { LIVE_EVENTS, LIVE_BAD, LIVE_LOST, LIVE_INTERVAL,
+                  LIVE_MIN, LIVE_MAX, LIVE_SETS };
 
-        return IRQ_HANDLED;
-}
+/* a 64 bit counter is two loads on 32 bit cpus: read again if it moved */
 
-/*
- *    read
- */
+static inline u64 live_u64 (u64 *counter) {
+        u64 val;
 
-ssize_t read (struct file *filp, char *buf,
-              const size_t count, loff_t *ppos) {
+        do {
+                val = READ_ONCE(*counter);
+        } while (val != READ_ONCE(*counter));
 
-        struct pin_data * events = filp->private_data;
-        int retval;
-        char stat[80];
-        int leng;
+        return val;
+}
 
-        events->done = 0;
-        retval = wait_event_interruptible (events->queue, events->done);
-        if (retval) return -ERESTARTSYS;
+static s64 live_value (struct pin_data * event, int field) {
+        long val;
+
+        switch (field) {
+        case LIVE_EVENTS:       return live_u64 (&event->total);
+        case LIVE_BAD:          return live_u64 (&event->totalbad);
+        case LIVE_LOST:         return live_u64 (&event->lost);
+        case LIVE_INTERVAL:     return READ_ONCE(event->nsdiff);
+        case LIVE_MIN:
+                val = READ_ONCE(event->amin);
+                return val == LONG_MAX ? 0 : val;
+        case LIVE_MAX:          return READ_ONCE(event->amax);
+        case LIVE_SETS:         return READ_ONCE(event->nset);
+        }
+        return 0;
+}
 
-        leng = scnprintf (stat, 80, "Events: %d in %ld usec on pin %d. Bad events: %ld\n",
-               events->setsize, events->set_time, events->pin, events->savebad);
+static ssize_t live_show (struct device *dev, char *buf, int field) {
+        struct pin_data * event;
+        s64 val = 0;
 
-        retval = copy_to_user (buf, stat, leng);
+        rcu_read_lock ();
+        event = rcu_dereference (live[MINOR(dev->devt) - BASE_MINOR]);
+        if (event) val = live_value (event, field);
+        rcu_read_unlock ();
 
-        return leng - retval;
+        if (event == NULL) return -ENODEV;
+        return sysfs_emit (buf, "%lld\n", val);
 }
 
+#define LIVE_ATTR(name, field)                                                  \
+static ssize_t name##_show (struct device *dev, struct device_attribute *attr,  \
+                            char *buf) {                                        \
+        return live_show (dev, buf, field);                                     \
+}                                                                               \
+static DEVICE_ATTR_RO(name)
+
+LIVE_ATTR(events, LIVE_EVENTS);
+LIVE_ATTR(bad, LIVE_BAD);
+LIVE_ATTR(lost, LIVE_LOST);
+LIVE_ATTR(interval, LIVE_INTERVAL);
+LIVE_ATTR(min, LIVE_MIN);
+LIVE_ATTR(max, LIVE_MAX);
+LIVE_ATTR(sets, LIVE_SETS);
+
+static struct attribute * pin_attrs[] = {
+        &dev_attr_cadence.attr,
+        &dev_attr_tolerance.attr,
+        &dev_attr_setsize.attr,
+        NULL,
+};
+
+static struct attribute * live_attrs[] = {
+        &dev_attr_events.attr,
+        &dev_attr_bad.attr,
+        &dev_attr_lost.attr,
+        &dev_attr_interval.attr,
+        &dev_attr_min.attr,
+        &dev_attr_max.attr,
+        &dev_attr_sets.attr,
+        NULL,
+};
+
+static const struct attribute_group pin_group = {
+        .attrs = pin_attrs,
+};
+
+static const struct attribute_group live_group = {
+        .name = "live",
+        .attrs = live_attrs,
+};
+
+static const struct attribute_group * pin_groups[] = {
+        &pin_group,
+        &live_group,
+        NULL,
+};
+
 /*
  * write
  */
@@ -203,13 +2115,28 @@ ssize_t write (struct file *filp, const char *user_buf,
 
 void resource_release (struct pin_data * event) {
 
+        if (rcu_access_pointer (live[event->minor]) == event) {
+                RCU_INIT_POINTER(live[event->minor], NULL);
+                synchronize_rcu ();     /* no sysfs read left on the counters */
+        }
+        debugfs_remove_recursive (event->ddir);   /* waits for the readers, before the frees */
+        hrtimer_cancel (&event->drive);
         if (event->irq) {
                disable_irq (event->irq); /* disable irq and wait for pending actions */
+               if (event->cpu >= 0) irq_set_affinity_hint (event->irq, NULL);
                free_irq(event->irq, event);
         }
+        cancel_work_sync (&event->report_work);
         if (event->gpio) gpiod_put (event->gpio);
         if (event->pin) gpio_free (event->pin);
-        kfree (event);
+        if (event->dgpio) gpiod_put (event->dgpio);
+        if (event->drvpin) gpio_free (event->drvpin);
+        if (event->ring) vfree (event->ring);
+        vfree (event->snap);
+        if (event->skew) WRITE_ONCE(edges[event->minor].tsource, -1);
+        vfree (event->skew);
+        free_percpu (event->cpustat);
+        kmem_cache_free (pin_cache, event);
 }
 
 /*
@@ -226,26 +2153,34 @@ int release (struct inode *inode, struct file *filp) {
 }
 
 /*
- *    open
+ *    pin_open - acquire pin <minor> and its drive pin, register the
+ *               interrupt routine and, if <generate>, start the generator
  */
 
-int open (struct inode *inode, struct file *filp) {
+static struct pin_data * pin_open (int minor, int generate) {
 
-        int status;
+        int status, j;
         struct pin_data * event;
-        int minor = MINOR(inode->i_rdev);
-
-        dbg_printk (0, "open device %d:%d pin %d\n",
-                MAJOR(inode->i_rdev), minor, pins[minor]);
 
         /* create data structure for events on this pin */
 
-        event = kzalloc (sizeof(struct pin_data), GFP_KERNEL);
+        event = kmem_cache_zalloc (pin_cache, GFP_KERNEL);
         if (event == NULL) {
                 dbg_printk (0, "Unable to obtain memory\n");
-                return -ENOMEM;
+                return ERR_PTR(-ENOMEM);
         }
-        filp->private_data = event;     /* save for read() and release() */
+        INIT_KFIFO(event->anomalies);
+        INIT_KFIFO(event->summaries);
+        INIT_KFIFO(event->stamps);
+        mutex_init (&event->rlock);
+        mutex_init (&event->slock);
+        mutex_init (&event->clock);
+        seqcount_init (&event->lseq);
+        init_completion (&event->statdone);
+        INIT_WORK(&event->report_work, report_drain);
+        hrtimer_init (&event->drive, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+        event->drive.function = drive_toggle;
+        event->cpu = -1;
 
         /* allocate gpio - another process request fails here */
 
@@ -265,18 +2200,105 @@ int open (struct inode *inode, struct file *filp) {
                 goto failure;
 	    }
 
+        /* drive pin, if any - starts low, the generator starts after the irq */
+
+        if (minor < ndrvpins && drvpins[minor]) {
+                status = gpio_request_one (drvpins[minor], GPIOF_OUT_INIT_LOW, NULL);
+                if (status) {
+                        dbg_printk(0, "Unable to obtain gpio %d.\n", drvpins[minor]);
+                        goto failure;
+                } else {
+                        event->drvpin = drvpins[minor];
+                }
+                event->dgpio = gpio_to_desc(drvpins[minor]);
+                if (event->dgpio == NULL) {
+                        dbg_printk(0, "Unable to obtain gpio descriptor %d.\n", drvpins[minor]);
+                        goto failure;
+                }
+                event->drvval = 1;
+        }
+
         init_waitqueue_head (&event->queue);
 
+        event->cpustat = alloc_percpu (struct cpu_stat);
+        if (event->cpustat == NULL) {
+                dbg_printk (0, "Unable to obtain memory for cpu statistics\n");
+                goto failure;
+        }
+
+        /* event ring - a control page followed by the event slots */
+
+        if (ringsize > 0) {
+                if (ringsize & (ringsize - 1)) {
+                        dbg_printk (0, "ringsize %d is not a power of 2\n", ringsize);
+                        goto failure;
+                }
+                event->ring = vmalloc_user (PAGE_SIZE +
+                                   PAGE_ALIGN(ringsize * sizeof(struct irqflow_event)));
+                if (event->ring == NULL) {
+                        dbg_printk (0, "Unable to obtain memory for the event ring\n");
+                        goto failure;
+                }
+                event->revent = (void *) event->ring + PAGE_SIZE;
+                event->rmask = ringsize - 1;
+                event->ring->size = ringsize;
+                event->ring->esize = sizeof(struct irqflow_event);
+                event->ring->offset = PAGE_SIZE;
+                event->ring->pin = event->pin;
+        }
+
+        /* correlation with the other pins */
+
+        event->minor = minor;
+        if (setlogs) setlogs[minor]->run++;
+        event->bank = BANK(pins[minor]);
+        event->skew = vzalloc (struct_size (event->skew, pair, npins));
+        if (event->skew == NULL) {
+                dbg_printk (0, "Unable to obtain memory for the skew histograms\n");
+                goto failure;
+        }
+
+        /* flight recorder snapshots */
+
+        if (snapwin > 0) {
+                event->snapwin = min (snapwin, MAXWIN);
+                event->snap = vzalloc (NSNAP * sizeof(struct snapshot));
+                if (event->snap == NULL) {
+                        dbg_printk (0, "Unable to obtain memory for the snapshots\n");
+                        goto failure;
+                }
+        }
+
         event->irq = gpiod_to_irq(event->gpio);
 
         /* everything is ready - register interrupt routine */
 
         event->count = -3;  /* ignore first events after irq line activation */
         //event->idle = 1;
-        event->setsize = setsize;
-        event->tmax = cadence + tolerance;
-        event->tmin = cadence - tolerance;
-        if (request_threaded_irq(event->irq, irq_service, NULL,
+        event->binary = binary;
+        event->imin = event->amin = LONG_MAX;
+        rcu_read_lock ();
+        config_latch (event, rcu_dereference (pconf[minor]));
+        rcu_read_unlock ();
+        event->dgen = event->cgen;
+        event->dcadence = event->cadence;
+        event->track = max (track, 0);
+        event->tsource = timesource;
+        if (event->tsource < 0 || event->tsource >= NTSRC ||
+            (event->tsource == TSRC_COUNTER && cnt_freq == 0)) {
+                dbg_printk (0, "timesource %d not available, using ktime\n", timesource);
+                event->tsource = TSRC_KTIME;
+        }
+        for ( j=0 ; j<NEDGE ; j++ ) atomic64_set (&edges[minor].t[j], 0);
+        edges[minor].next = 0;
+        WRITE_ONCE(edges[minor].tsource, event->tsource);
+        event->countonly = generate ? countonly : 0;   /* the sweep always checks */
+        event->split = event->countonly ? 0 : split;
+        rate_take (event, &event->rstart);
+        event->rprev = event->rstart;
+        if (request_threaded_irq(event->irq, event->countonly ? irq_count :
+                        event->split ? irq_stamp : irq_service,
+                        event->split ? irq_verify : NULL,
                         IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING, "irqflow", event)) {
 		        dbg_printk(0, "can't register IRQ %d\n", event->irq);
                 event->irq = 0;
@@ -285,13 +2307,292 @@ int open (struct inode *inode, struct file *filp) {
        
         dbg_printk(1, "Registered IRQ %d for pin %d.\n", event->irq, event->pin);
 
-        return 0;
+        /* bind the irq to the requested cpu - not fatal if refused */
+
+        if (minor < naffinity && affinity[minor] >= 0) {
+                if (affinity[minor] >= nr_cpu_ids || !cpu_online (affinity[minor])) {
+                        dbg_printk (0, "cpu %d not available for pin %d\n",
+                                    affinity[minor], event->pin);
+                } else if ((status = irq_set_affinity_hint (event->irq,
+                                                        cpumask_of (affinity[minor])))) {
+                        dbg_printk (0, "can't bind IRQ %d to cpu %d: %d\n",
+                                    event->irq, affinity[minor], status);
+                } else {
+                        event->cpu = affinity[minor];
+                }
+        }
+
+        /* start the generator */
+
+        if (event->dgpio && generate) {
+                hrtimer_start (&event->drive, ns_to_ktime (event->cadence), HRTIMER_MODE_REL_HARD);
+                dbg_printk(1, "Driving pin %d from pin %d every %ld us.\n",
+                           event->pin, event->drvpin, event->cadence / 1000);
+        }
+
+        /* histograms in /sys/kernel/debug/irqflow/pin<n>/hist */
+
+        if (debug_dir) {
+                char name[16];
+                snprintf (name, sizeof(name), "pin%d", event->pin);
+                event->ddir = debugfs_create_dir (name, debug_dir);
+                debugfs_create_file ("hist", S_IRUGO, event->ddir, event, &hist_fops);
+                debugfs_create_file ("summary", S_IRUGO, event->ddir, event, &summary_fops);
+                debugfs_create_file ("cpus", S_IRUGO, event->ddir, event, &cpus_fops);
+                debugfs_create_file ("rate", S_IRUGO, event->ddir, event, &rate_fops);
+                debugfs_create_file ("snapshot", S_IRUSR, event->ddir, event, &snapshot_fops);
+                debugfs_create_file ("skew", S_IRUGO, event->ddir, event, &skew_fops);
+                debugfs_create_file ("dispatch", S_IRUGO, event->ddir, event, &dispatch_fops);
+        }
+
+        rcu_assign_pointer (live[minor], event);
+
+        return event;
 
 failure:
         resource_release (event);
-        return -1;
+        return ERR_PTR(-EPERM);
+}
+
+/*
+ *    sweep - two pins driven in step with a programmable delay; the
+ *    lagging edge is busy waited for below SWEEP_SPIN ns, or set from
+ *    a second hrtimer
+ */
+
+struct sweep_data {
+        struct pin_data *event[2];     /* pins[0] lags pins[1] by <delay> */
+        struct hrtimer timer;
+        struct hrtimer lag;            /* the lagging edge, for long delays */
+        struct pin_data *second;       /* pin and value of the lagging edge */
+        int lagval;
+        long cadence;                  /* ns half period */
+        int val;                       /* next value to be sent */
+        long delay;                    /* ns delay in use */
+        long next;                     /* ns delay of the next step */
+        long to, step, size;           /* sweep limits, as at open */
+        int header;                    /* table header printed */
+        u64 total[2], lost[2], bad[2]; /* counters at the start of the step */
+};
+
+static enum hrtimer_restart sweep_toggle (struct hrtimer *timer) {
+        struct sweep_data * sw = container_of (timer, struct sweep_data, timer);
+        long delay = READ_ONCE(sw->delay);
+        struct pin_data * first = sw->event[delay < 0 ? 0 : 1];
+        struct pin_data * second = sw->event[delay < 0 ? 1 : 0];
+
+        drive_set (first, sw->val);
+        if (abs(delay) < SWEEP_SPIN) {
+                ndelay (abs(delay));
+                drive_set (second, sw->val);
+        } else {
+                sw->second = second;
+                sw->lagval = sw->val;
+                hrtimer_start (&sw->lag, ns_to_ktime (abs(delay)), HRTIMER_MODE_REL_HARD);
+        }
+        sw->val ^= 1;
+
+        hrtimer_forward_now (timer, ns_to_ktime (sw->cadence));
+        return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart sweep_lag (struct hrtimer *timer) {
+        struct sweep_data * sw = container_of (timer, struct sweep_data, lag);
+
+        drive_set (sw->second, sw->lagval);
+        return HRTIMER_NORESTART;
+}
+
+void sweep_free (struct sweep_data * sw) {
+        int j;
+
+        hrtimer_cancel (&sw->timer);
+        hrtimer_cancel (&sw->lag);
+        for ( j=0 ; j<2 ; j++ )
+                if (!IS_ERR_OR_NULL(sw->event[j])) resource_release (sw->event[j]);
+        kfree (sw);
+}
+
+/*
+ *  one step of the sweep: set the delay, let the flow settle and wait
+ *  for <sweepsize> events on both pins
+ */
+
+static int sweep_step (struct sweep_data * sw) {
+        u64 done, seen = 0;
+        int j, idle = 0;
+
+        WRITE_ONCE(sw->delay, sw->next);
+        if (msleep_interruptible (SWEEP_SETTLE)) return -ERESTARTSYS;
+        for ( j=0 ; j<2 ; j++ ) {
+                sw->total[j] = READ_ONCE(sw->event[j]->total);
+                sw->lost[j] = READ_ONCE(sw->event[j]->lost);
+                sw->bad[j] = READ_ONCE(sw->event[j]->totalbad);
+        }
+
+        for (;;) {
+                if (msleep_interruptible (100)) return -ERESTARTSYS;
+                done = min (READ_ONCE(sw->event[0]->total) - sw->total[0],
+                            READ_ONCE(sw->event[1]->total) - sw->total[1]);
+                if (done >= sw->size) break;
+                if (done > seen) idle = 0;
+                else if (++idle == SWEEP_IDLE) {
+                        dbg_printk (0, "no events on pins %d:%d - are the jumpers in place?\n",
+                                    sw->event[0]->pin, sw->event[1]->pin);
+                        return -EIO;
+                }
+                seen = done;
+        }
+
+        for ( j=0 ; j<2 ; j++ ) {
+                sw->total[j] = READ_ONCE(sw->event[j]->total) - sw->total[j];
+                sw->lost[j] = READ_ONCE(sw->event[j]->lost) - sw->lost[j];
+                sw->bad[j] = READ_ONCE(sw->event[j]->totalbad) - sw->bad[j];
+        }
+        return 0;
+}
+
+/*
+ *  sweep read - one table line for each delay, end of file at the end
+ */
+
+ssize_t sweep_read (struct file *filp, char *buf,
+                    const size_t count, loff_t *ppos) {
+
+        struct sweep_data * sw = filp->private_data;
+        char line[240];
+        int leng = 0;
+        int status, j;
+        u32 frac;
+        u64 rate;
+
+        if (sw->next > sw->to) return 0;     /* sweep over */
+
+        if (!sw->header) {
+                leng = scnprintf (line, sizeof(line), "# delay_ns   events_%d lost_%d bad_%d  lost%%"
+                                  "   events_%d lost_%d bad_%d  lost%%\n",
+                                  sw->event[0]->pin, sw->event[0]->pin, sw->event[0]->pin,
+                                  sw->event[1]->pin, sw->event[1]->pin, sw->event[1]->pin);
+                sw->header = 1;
+        }
+
+        status = sweep_step (sw);
+        if (status) return status;
+
+        leng += scnprintf (line + leng, sizeof(line) - leng, "%10ld", sw->next);
+        for ( j=0 ; j<2 ; j++ ) {
+                rate = div64_u64 (sw->lost[j] * 100000, max (sw->total[j], 1ULL));
+                rate = div_u64_rem (rate, 1000, &frac);
+                leng += scnprintf (line + leng, sizeof(line) - leng, " %10llu %7llu %7llu %3llu.%03u",
+                                   sw->total[j], sw->lost[j], sw->bad[j], rate, frac);
+        }
+        leng += scnprintf (line + leng, sizeof(line) - leng, "\n");
+        sw->next += sw->step;
+
+        if (leng > count) leng = count;
+        if (copy_to_user (buf, line, leng)) return -EFAULT;
+
+        return leng;
+}
+
+int sweep_release (struct inode *inode, struct file *filp) {
+
+        dbg_printk (0, "close request for the sweep\n");
+        sweep_free (filp->private_data);
+
+        return 0;
+}
+
+static struct file_operations sweep_fops= {
+        .owner = THIS_MODULE,
+        .release = sweep_release,
+        .read = sweep_read,
+};
+
+/*
+ *    sweep_open - acquire the first two pins, without their generators,
+ *                 and start the common one
+ */
+
+static int sweep_open (struct file *filp) {
+        struct sweep_data * sw;
+        int j, status;
+
+        if (sweepstep <= 0 || sweepsize <= 0 ||
+            max (abs(sweepfrom), abs(sweepto)) >= cadence * 1000L) {
+                dbg_printk (0, "bad sweep %d:%d:%d ns with cadence %d us\n",
+                            sweepfrom, sweepstep, sweepto, cadence);
+                return -EINVAL;
+        }
+
+        sw = kzalloc (sizeof(struct sweep_data), GFP_KERNEL);
+        if (sw == NULL) {
+                dbg_printk (0, "Unable to obtain memory\n");
+                return -ENOMEM;
+        }
+        hrtimer_init (&sw->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+        sw->timer.function = sweep_toggle;
+        hrtimer_init (&sw->lag, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+        sw->lag.function = sweep_lag;
+
+        for ( j=0 ; j<2 ; j++ ) {
+                sw->event[j] = pin_open (j, 0);
+                if (IS_ERR(sw->event[j])) {
+                        status = PTR_ERR(sw->event[j]);
+                        goto failure;
+                }
+                if (sw->event[j]->dgpio == NULL) {
+                        dbg_printk (0, "pin %d has no drive pin\n", sw->event[j]->pin);
+                        status = -ENODEV;
+                        goto failure;
+                }
+        }
+
+        sw->cadence = cadence * 1000L;
+        sw->val = 1;
+        sw->next = sweepfrom;
+        sw->delay = sweepfrom;
+        sw->to = sweepto;
+        sw->step = sweepstep;
+        sw->size = sweepsize;
+        filp->private_data = sw;
+        hrtimer_start (&sw->timer, ns_to_ktime (sw->cadence), HRTIMER_MODE_REL_HARD);
+        dbg_printk (0, "sweep of pin %d against pin %d from %d to %d ns\n",
+                    sw->event[0]->pin, sw->event[1]->pin, sweepfrom, sweepto);
+
+        return 0;
+
+failure:
+        sweep_free (sw);
+        return status;
+}
+
+/*
+ *    open
+ */
+
+int open (struct inode *inode, struct file *filp) {
+
+        struct pin_data * event;
+        int minor = MINOR(inode->i_rdev);
+
+        if (minor == npins) {
+                dbg_printk (0, "open sweep device %d:%d\n", MAJOR(inode->i_rdev), minor);
+                replace_fops (filp, fops_get (&sweep_fops));    /* put with the old ones */
+                return sweep_open (filp);
+        }
+
+        dbg_printk (0, "open device %d:%d pin %d\n",
+                MAJOR(inode->i_rdev), minor, pins[minor]);
+
+        event = pin_open (minor, 1);
+        if (IS_ERR(event)) return PTR_ERR(event);
+        filp->private_data = event;     /* save for read() and release() */
+
+        return 0;
 }
 
+
 /*
  *    fops for the irqflow devices
  */
@@ -302,6 +2603,10 @@ static struct file_operations fops= {
         .release = release,
         .read = read,
         .write = write,
+        .mmap = mmap,
+        .unlocked_ioctl = ioctl,
+        .compat_ioctl = compat_ptr_ioctl,     /* same layout for 32 bit programs */
+        .poll = poll,
 };
 
 /*
@@ -314,13 +2619,44 @@ static void mod_exit (void) {
         dbg_printk (0, "Unloading module.\n");
 
         major = MAJOR(device);
-        for ( j=0 ; j<npins ; j++ ) {
-                if (dev_device[j]) device_destroy (dev_class,
+        for ( j=0 ; j<=npins ; j++ ) {
+                if (dev_device && dev_device[j]) device_destroy (dev_class,
                                             MKDEV(major, j + BASE_MINOR));
         }
         if (dev_class) class_destroy (dev_class);
         if (cdev_flag) cdev_del (&cdev);
-        if (device) unregister_chrdev_region(device, npins);
+        if (device) unregister_chrdev_region(device, npins + 1);
+        debugfs_remove_recursive (debug_dir);
+        free_percpu (banks);
+        kfree (edges);
+        for ( j=0 ; pconf && j<npins ; j++ ) kfree (rcu_dereference_protected (pconf[j], 1));
+        kfree (pconf);
+        kfree (live);
+        for ( j=0 ; setlogs && j<npins ; j++ ) vfree (setlogs[j]);
+        kfree (setlogs);
+        kfree (dev_device);
+        kmem_cache_destroy (pin_cache);
+}
+
+/*
+ *      counter_calibrate - measure the arch counter against ktime and
+ *                         set the scaling to ns; no scaling if it does not run
+ */
+
+static void counter_calibrate (void) {
+        u64 t0, t1;
+        u64 c0, c1;
+
+        c0 = read_counter();
+        t0 = ktime_get_ns();
+        msleep (20);
+        c1 = read_counter();
+        t1 = ktime_get_ns();
+
+        if (c1 <= c0 || t1 <= t0) return;
+        cnt_freq = div64_u64 ((c1 - c0) * NSEC_PER_SEC, t1 - t0);
+        clocks_calc_mult_shift (&cnt_mult, &cnt_shift, cnt_freq, NSEC_PER_SEC, 3600);
+        dbg_printk (1, "arch counter at %u Hz\n", cnt_freq);
 }
 
 /*
@@ -335,7 +2671,7 @@ static int mod_init (void) {
 
         /* obtain major device number or exit */
 
-        status = alloc_chrdev_region (&device, BASE_MINOR, npins, NAME);
+        status = alloc_chrdev_region (&device, BASE_MINOR, npins + 1, NAME);
         if (status < 0) {
                 dbg_printk (0, "can't get major\n");
                 return status;
@@ -343,12 +2679,67 @@ static int mod_init (void) {
         major = MAJOR(device);
         dbg_printk (0, "major is %d\n", major);
 
+        debug_dir = debugfs_create_dir (NAME, NULL);
+        counter_calibrate ();
+        if (debug_dir) debugfs_create_file ("clocks", S_IRUGO, debug_dir, NULL, &clocks_fops);
+
+        /* bank dispatch statistics - for the life of the module */
+
+        banks = alloc_percpu (struct bank_cpu);
+        if (banks == NULL) {
+                dbg_printk (0, "Unable to obtain memory for the bank statistics\n");
+                status = -ENOMEM;
+                goto failure;
+        }
+        if (debug_dir) debugfs_create_file ("banks", S_IRUGO, debug_dir, NULL, &banks_fops);
+
+        /* pin tables for the pins given at load */
+
+        /* a power of two size, for kmalloc to align the lines */
+        edges = kcalloc (roundup_pow_of_two (npins), sizeof(struct edge_log), GFP_KERNEL);
+        pconf = kcalloc (npins, sizeof(*pconf), GFP_KERNEL);
+        live = kcalloc (npins, sizeof(*live), GFP_KERNEL);
+        dev_device = kcalloc (npins + 1, sizeof(struct device *), GFP_KERNEL);
+        pin_cache = kmem_cache_create (NAME "_pin", sizeof(struct pin_data), 0,
+                                       SLAB_HWCACHE_ALIGN, NULL);
+        if (edges == NULL || pconf == NULL || live == NULL || dev_device == NULL || pin_cache == NULL) {
+                dbg_printk (0, "Unable to obtain memory for the pin tables\n");
+                status = -ENOMEM;
+                goto failure;
+        }
+
+        /* summary history in /sys/kernel/debug/irqflow/history/pin<n> */
+
+        if (history & (history - 1)) {
+                dbg_printk (0, "history %d is not a power of 2, no history kept\n", history);
+        } else if (history > 0) {
+                struct dentry * hdir = NULL;
+
+                setlogs = kcalloc (npins, sizeof(struct set_log *), GFP_KERNEL);
+                for ( j=0 ; setlogs && j<npins ; j++ ) {
+                        setlogs[j] = vzalloc (struct_size (setlogs[j], rec, history));
+                        if (setlogs[j] == NULL) break;
+                        setlogs[j]->mask = history - 1;
+                }
+                if (setlogs == NULL || j < npins) {
+                        dbg_printk (0, "Unable to obtain memory for the history\n");
+                        status = -ENOMEM;
+                        goto failure;
+                }
+                if (debug_dir) hdir = debugfs_create_dir ("history", debug_dir);
+                for ( j=0 ; hdir && j<npins ; j++ ) {
+                        char name[16];
+                        snprintf (name, sizeof(name), "pin%d", pins[j]);
+                        debugfs_create_file (name, S_IRUGO, hdir, setlogs[j], &history_fops);
+                }
+        }
+
         /* create and register the device */
 
         cdev_init(&cdev, &fops);
         cdev.owner = THIS_MODULE;
 
-        status = cdev_add (&cdev, device, npins);
+        status = cdev_add (&cdev, device, npins + 1);
         if (status) {
                 dbg_printk (0, "can't register device %d %ld\n", device, status);
                 goto failure;
@@ -366,8 +2757,8 @@ static int mod_init (void) {
                 goto failure;
         }
         for ( j=0 ; j<npins ; j++ ) {
-                dev_device[j] = device_create(dev_class, NULL,
-                           MKDEV(major, j + BASE_MINOR), NULL, NAME "/pin%d", pins[j]);
+                dev_device[j] = device_create_with_groups(dev_class, NULL,
+                           MKDEV(major, j + BASE_MINOR), NULL, pin_groups, NAME "/pin%d", pins[j]);
 
                 dbg_printk (0, "created device %d %p\n", j, dev_device[j]);
 
@@ -379,6 +2770,19 @@ static int mod_init (void) {
                 }
         }
 
+        /* the sweep device - minor <npins> */
+
+        if (npins >= 2) {
+                dev_device[npins] = device_create(dev_class, NULL,
+                           MKDEV(major, npins + BASE_MINOR), NULL, NAME "/sweep");
+                if (IS_ERR(dev_device[npins])) {
+                        dbg_printk (0, "create of sweep device failed\n");
+                        status = (long) dev_device[npins];
+                        dev_device[npins] = NULL;
+                        goto failure;
+                }
+        }
+
         dbg_printk (0, "installed by \"%s\" (pid %i) at %p\n", current->comm, current->pid, current);
 
         return 0;
@@ -0,0 +1,98 @@
+/**************************************************************************
+ *    irqflow.h - Data structures shared between the irqflow module and   *
+ *                user space programs                                     *
+ *                                                                        *
+ *  by:           Marcello Carla'                                         *
+ *  at:           Department of Physics - University of Florence, Italy   *
+ *  email:        carla@fi.infn.it                                        *
+ *                                                                        *
+ *  Copyright: (2023) Marcello Carla'                                     *
+ *  This program is free software; you can redistribute it and/or modify  *
+ *  it under the terms of the GNU General Public License as published by  *
+ *  the Free Software Foundation; either version 2 of the License, or     *
+ *  (at your option) any later version.                                   *
+ *                                                                        *
+ **************************************************************************/
+
+#ifndef IRQFLOW_H
+#define IRQFLOW_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ *  event ring - mmap() of /dev/irqflow/pin<n> gives a control page
+ *  followed by <size> struct irqflow_event slots. The interrupt routine
+ *  fills slot (head % size) and then advances head; the reader consumes
+ *  slot (tail % size) and then advances tail. Both indices run freely
+ *  and wrap at 2^32. When head - tail == size the ring is full and new
+ *  events are dropped and counted in <lost>.
+ */
+
+struct irqflow_event {
+        __u64 time;               /* ns timestamp of the interrupt */
+        __u32 val;                /* line value read by the interrupt routine */
+        __u32 cpu;                /* cpu that serviced the interrupt */
+};
+
+struct irqflow_ring {
+        __u32 size;               /* number of event slots - a power of 2 */
+        __u32 esize;              /* size of one event slot */
+        __u32 offset;             /* byte offset of the first slot in the mapping */
+        __u32 pin;                /* gpio line number */
+        __u32 head                /* written by the module only */
+                __attribute__ ((aligned (64)));
+        __u32 lost;               /* events dropped with the ring full */
+        __u32 tail                /* written by the reader only */
+                __attribute__ ((aligned (64)));
+};
+
+/*
+ *  set summary - with binary=1, read() of /dev/irqflow/pin<n> returns
+ *  an array of these records, one for every <setsize> events; sets are
+ *  numbered from 1 at open, a gap in <set> means that summaries were
+ *  dropped because the reader did not keep up
+ */
+
+struct irqflow_summary {
+        __u32 set;                /* set number since open */
+        __u32 pin;                /* gpio line number */
+        __u32 events;             /* events in the set */
+        __u32 bad;                /* bad events in the set */
+        __u64 set_time;           /* ns length of the set */
+        __u32 imin, imax;         /* ns shortest and longest interval */
+        __u32 jitter[4];          /* ns p50, p99, p99.9, max deviation from cadence */
+        __u32 hard_avg, hard_max; /* ns mean and longest interrupt routine */
+        __u32 dropped;            /* split mode: events lost before the checks */
+        __u32 lat_avg, lat_max;   /* ns mean and longest drive pin to interrupt */
+        __u32 lost;               /* bad events with edges lost */
+        __u32 late, early;        /* bad events with interval too long, too short */
+        __u32 duplicate;          /* bad events with an edge seen twice */
+        __u32 missed;             /* edges estimated lost in the lost and late events */
+        __u32 track_freq;         /* tracking mode: mHz of the flow, 0 if not locked */
+        __u32 track_phase;        /* tracking mode: ns largest phase error */
+};
+
+/*
+ *  session control - ioctl() on /dev/irqflow/pin<n>; the interrupt stays
+ *  registered and the line allocated, only the checks are switched, so
+ *  that a new run starts at once. A device is armed at open.
+ */
+
+struct irqflow_stats {
+        __u64 time;               /* ns timestamp of the event the counters were taken at */
+        __u64 events, bad;        /* events and bad events since open or reset */
+        __u64 lost;               /* lost edge events since open or reset */
+        __u32 sets;               /* sets completed since open or reset */
+        __u32 set_events;         /* events in the current set */
+        __u32 set_bad;            /* bad events in the current set */
+        __u32 armed;              /* 1 if the events are checked */
+};
+
+#define IRQFLOW_IOC 0x66
+#define IRQFLOW_ARM     _IO(IRQFLOW_IOC, 1)     /* check the events, from the next one */
+#define IRQFLOW_DISARM  _IO(IRQFLOW_IOC, 2)     /* ignore the events */
+#define IRQFLOW_RESET   _IO(IRQFLOW_IOC, 3)     /* clear counters, histograms, queued summaries */
+#define IRQFLOW_STATS   _IOR(IRQFLOW_IOC, 4, struct irqflow_stats)   /* consistent counters */
+
+#endif
@@ -0,0 +1,111 @@
+/**************************************************************************
+ *    irqlevel_trace.h - Trace events of the irqlevel module              *
+ *                                                                        *
+ *    Enable with:                                                        *
+ *      echo 1 > /sys/kernel/tracing/events/irqlevel/enable               *
+ *    and read the lock-free trace buffer in                              *
+ *      /sys/kernel/tracing/trace_pipe (or use perf/trace-cmd)            *
+ *                                                                        *
+ *  Copyright: (2023) Marcello Carla'                                     *
+ *  This program is free software; you can redistribute it and/or modify  *
+ *  it under the terms of the GNU General Public License as published by  *
+ *  the Free Software Foundation; either version 2 of the License, or     *
+ *  (at your option) any later version.                                   *
+ *                                                                        *
+ **************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM irqlevel
+
+#if !defined(_IRQLEVEL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IRQLEVEL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* every interrupt serviced */
+
+TRACE_EVENT(irqlevel_event,
+
+        TP_PROTO(int pin, int val, long nsdiff, long count),
+
+        TP_ARGS(pin, val, nsdiff, count),
+
+        TP_STRUCT__entry(
+                __field(int, pin)
+                __field(int, val)
+                __field(long, nsdiff)
+                __field(long, count)
+        ),
+
+        TP_fast_assign(
+                __entry->pin = pin;
+                __entry->val = val;
+                __entry->nsdiff = nsdiff;
+                __entry->count = count;
+        ),
+
+        TP_printk("pin %d - val %d after %ld ns  ev.: %ld",
+                __entry->pin, __entry->val, __entry->nsdiff, __entry->count)
+);
+
+/* an interrupt out of the regular flow */
+
+TRACE_EVENT(irqlevel_anomaly,
+
+        TP_PROTO(int pin, int irq, int oldval, int val, int level, long nsdiff,
+                 long olddiff, long bad, long count, int kind,
+                 int near, long nearns),
+
+        TP_ARGS(pin, irq, oldval, val, level, nsdiff, olddiff, bad, count, kind, near, nearns),
+
+        TP_STRUCT__entry(
+                __field(int, pin)
+                __field(int, irq)
+                __field(int, oldval)
+                __field(int, val)
+                __field(int, level)
+                __field(long, nsdiff)
+                __field(long, olddiff)
+                __field(long, bad)
+                __field(long, count)
+                __field(int, kind)
+                __field(int, near)
+                __field(long, nearns)
+        ),
+
+        TP_fast_assign(
+                __entry->pin = pin;
+                __entry->irq = irq;
+                __entry->oldval = oldval;
+                __entry->val = val;
+                __entry->level = level;
+                __entry->nsdiff = nsdiff;
+                __entry->olddiff = olddiff;
+                __entry->bad = bad;
+                __entry->count = count;
+                __entry->kind = kind;
+                __entry->near = near;
+                __entry->nearns = nearns;
+        ),
+
+        TP_printk("irq %d:%d - val %d -> %d : %d  after %ld / %ld ns  bad ev.: %ld:%ld %s near %d %ld ns",
+                __entry->pin, __entry->irq, __entry->oldval, __entry->val,
+                __entry->level, __entry->nsdiff, __entry->olddiff, __entry->bad, __entry->count,
+                __print_symbolic(__entry->kind,         /* BAD_... in irqlevel.c */
+                        { 0, "" },
+                        { 1, "lost" },
+                        { 2, "late" },
+                        { 3, "early" },
+                        { 4, "duplicate" }),
+                __entry->near, __entry->nearns)
+);
+
+#endif /* _IRQLEVEL_TRACE_H */
+
+/* this header is not in include/trace/events: tell define_trace.h where it is */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE irqlevel_trace
+#include <trace/define_trace.h>